@@ -0,0 +1,207 @@
+/*
+
+  Benchmark for the point-in-polygon kernels used by "osmium extract".
+
+  Usage: benchmark_point_in_polygon POLY-FILE... [NUM-POINTS]
+
+  Reads each (multi)polygon from the .poly files (for instance the country
+  polygons from http://download.geofabrik.de/) and tests the same random
+  locations in the envelope of the polygon with the original segment based
+  implementation and each point-in-polygon kernel available on this CPU.
+  The grid of inside/outside cells ExtractPolygon uses in front of the
+  kernels is not used here, so all locations go through the kernels.
+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/segment.hpp>
+
+#include "point_in_polygon.hpp"
+#include "poly_file_parser.hpp"
+
+namespace {
+
+    std::vector<osmium::Segment> get_segments(const osmium::Area& area) {
+        std::vector<osmium::Segment> segments;
+        const auto add_ring = [&segments](const osmium::NodeRefList& ring) {
+            for (auto it = std::next(ring.begin()); it != ring.end(); ++it) {
+                segments.emplace_back(std::prev(it)->location(), it->location());
+            }
+        };
+
+        for (const auto& outer_ring : area.outer_rings()) {
+            add_ring(outer_ring);
+            for (const auto& inner_ring : area.inner_rings(outer_ring)) {
+                add_ring(inner_ring);
+            }
+        }
+
+        return segments;
+    }
+
+    // The implementation used before the kernels were introduced: The
+    // segments of each band are stored as osmium::Segment objects and
+    // tested one after the other.
+    class SegmentBands {
+
+        std::vector<std::vector<osmium::Segment>> m_bands;
+        int32_t m_y_min;
+        int32_t m_dy;
+
+    public:
+
+        SegmentBands(const std::vector<osmium::Segment>& segments, const osmium::Box& envelope) :
+            m_y_min(envelope.bottom_left().y()) {
+            const int32_t num_bands = std::max(1, std::min(10000, static_cast<int32_t>(segments.size()) / 10));
+            m_bands.resize(num_bands);
+            m_dy = std::max(1, (envelope.top_right().y() - m_y_min) / num_bands);
+
+            for (const auto& segment : segments) {
+                const std::pair<int32_t, int32_t> mm = std::minmax(segment.first().y(), segment.second().y());
+                const int32_t band_min = (mm.first - m_y_min) / m_dy;
+                const int32_t band_max = std::min(num_bands, ((mm.second - m_y_min) / m_dy) + 1);
+                for (auto band = band_min; band < band_max; ++band) {
+                    m_bands[band].push_back(segment);
+                }
+            }
+        }
+
+        bool contains(const osmium::Location& location) const noexcept {
+            std::size_t band = (location.y() - m_y_min) / m_dy;
+            if (band >= m_bands.size()) {
+                band = m_bands.size() - 1;
+            }
+
+            bool inside = false;
+            for (const auto& segment : m_bands[band]) {
+                if (segment.first() == location || segment.second() == location) {
+                    return true;
+                }
+                if ((segment.second().y() > location.y()) != (segment.first().y() > location.y())) {
+                    const int64_t ax = int64_t(segment.first().x()) - int64_t(segment.second().x());
+                    const int64_t ay = int64_t(segment.first().y()) - int64_t(segment.second().y());
+                    const int64_t tx = int64_t(location.x())        - int64_t(segment.second().x());
+                    const int64_t ty = int64_t(location.y())        - int64_t(segment.second().y());
+
+                    const bool comp = tx * ay < ax * ty;
+
+                    if ((ay > 0) == comp) {
+                        inside = !inside;
+                    }
+                }
+            }
+
+            return inside;
+        }
+
+    }; // class SegmentBands
+
+    // Returns the time per location in ns, the number of locations
+    // inside the polygon is returned in inside.
+    template <typename TPolygon>
+    double run(const char* name, const TPolygon& polygon, const std::vector<osmium::Location>& locations, double reference, std::size_t& inside) {
+        const auto start = std::chrono::steady_clock::now();
+        inside = 0;
+        for (const auto& location : locations) {
+            if (polygon.contains(location)) {
+                ++inside;
+            }
+        }
+        const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        const double ns_per_point = duration.count() * 1e9 / locations.size();
+        std::cout << "  " << name << ": " << ns_per_point << " ns/point";
+        if (reference > 0) {
+            std::cout << " (" << reference / ns_per_point << "x)";
+        }
+        std::cout << " inside=" << inside << "\n";
+
+        return ns_per_point;
+    }
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> file_names;
+    std::size_t num_points = 1000000;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        if (arg.find_first_not_of("0123456789") == std::string::npos) {
+            num_points = std::stoul(arg);
+        } else {
+            file_names.push_back(arg);
+        }
+    }
+
+    if (file_names.empty() || num_points == 0) {
+        std::cerr << "Usage: " << argv[0] << " POLY-FILE... [NUM-POINTS]\n";
+        return 2;
+    }
+
+    std::cout << "kernels available:";
+    for (const auto kernel : available_pip_kernels()) {
+        std::cout << ' ' << pip_kernel_name(kernel);
+    }
+    std::cout << "\n";
+
+    std::mt19937 gen{42};
+    int result = 0;
+
+    for (const auto& file_name : file_names) {
+        try {
+            osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+            PolyFileParser{buffer, file_name}();
+            const auto& area = buffer.get<osmium::Area>(0);
+
+            const auto segments = get_segments(area);
+            const auto envelope = area.envelope();
+
+            std::uniform_int_distribution<int32_t> dist_x{envelope.bottom_left().x(), envelope.top_right().x()};
+            std::uniform_int_distribution<int32_t> dist_y{envelope.bottom_left().y(), envelope.top_right().y()};
+            std::vector<osmium::Location> locations;
+            locations.reserve(num_points);
+            for (std::size_t n = 0; n < num_points; ++n) {
+                locations.emplace_back(dist_x(gen), dist_y(gen));
+            }
+
+            std::cout << file_name << ": " << segments.size() << " segments, " << num_points << " points, best kernel "
+                      << pip_kernel_name(best_pip_kernel(envelope)) << "\n";
+
+            std::size_t expected = 0;
+            const SegmentBands original{segments, envelope};
+            const double reference = run("original", original, locations, 0, expected);
+
+            for (const auto kernel : available_pip_kernels()) {
+                std::size_t inside = 0;
+                const PolygonBands bands{segments, envelope, kernel};
+                run(pip_kernel_name(kernel), bands, locations, reference, inside);
+                if (inside != expected) {
+                    std::cerr << "ERROR: kernel " << pip_kernel_name(kernel) << " has different result\n";
+                    result = 1;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 2;
+        }
+    }
+
+    return result;
+}
@@ -5,8 +5,8 @@
 #  Then runs a test command given in the variable 'cmd' in directory 'dir'.
 #  Checks that the return code is 0.
 #  Checks that there is nothing on stderr.
-#  If the variable 'cmd2' is set, the command will be run and checked in the
-#  same manner.
+#  If the variables 'cmd2', 'cmd3', ... are set, those commands will be run
+#  one after the other and checked in the same manner.
 #  Compares output on stdout with reference file in variable 'reference'.
 #
 
@@ -50,12 +50,17 @@ if(result)
     message(FATAL_ERROR "Error when calling '${cmd}': ${result}")
 endif()
 
-if(cmd2)
-    message("Executing: ${cmd2}")
-    separate_arguments(cmd2)
+foreach(_n RANGE 2 9)
+    if(NOT cmd${_n})
+        break()
+    endif()
+
+    set(_cmd ${cmd${_n}})
+    message("Executing: ${_cmd}")
+    separate_arguments(_cmd)
 
     execute_process(
-        COMMAND ${cmd2}
+        COMMAND ${_cmd}
         WORKING_DIRECTORY ${dir}
         RESULT_VARIABLE result
         OUTPUT_FILE ${output}
@@ -67,9 +72,9 @@ if(cmd2)
     endif()
 
     if(result)
-        message(FATAL_ERROR "Error when calling '${cmd}': ${result}")
+        message(FATAL_ERROR "Error when calling '${_cmd}': ${result}")
     endif()
-endif()
+endforeach()
 
 set(compare "${CMAKE_COMMAND} -E compare_files ${reference} ${output}")
 message("Executing: ${compare}")
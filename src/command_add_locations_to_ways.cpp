@@ -20,8 +20,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <initializer_list>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -34,9 +41,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
 #include <osmium/memory/buffer.hpp>
+#include <osmium/osm/entity_bits.hpp>
 #include <osmium/osm/item_type.hpp>
 #include <osmium/osm/location.hpp>
 #include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
 #include <osmium/osm/types.hpp>
 #include <osmium/util/progress_bar.hpp>
 #include <osmium/util/verbose_output.hpp>
@@ -45,6 +54,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "command_add_locations_to_ways.hpp"
 #include "exception.hpp"
 #include "util.hpp"
+#include "way_node_locations.hpp"
 
 bool CommandAddLocationsToWays::setup(const std::vector<std::string>& arguments) {
     const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
@@ -56,6 +66,9 @@ bool CommandAddLocationsToWays::setup(const std::vector<std::string>& arguments)
     ("show-index-types,I", "Show available index types")
     ("keep-untagged-nodes,n", "Keep untagged nodes")
     ("ignore-missing-nodes", "Ignore missing nodes")
+    ("index-file", po::value<std::string>(), "Keep node location index in this file (reused if it exists)")
+    ("threads", po::value<unsigned int>(), "Number of threads to use for location lookups (default: number of CPUs)")
+    ("two-pass", "Read input twice and only index nodes referenced by ways")
     ;
 
     po::options_description opts_common{add_common_options()};
@@ -94,11 +107,35 @@ bool CommandAddLocationsToWays::setup(const std::vector<std::string>& arguments)
         }
     }
 
+    if (vm.count("index-file")) {
+        m_index_file_name = vm["index-file"].as<std::string>();
+        if (vm["index-type"].defaulted()) {
+            m_index_type_name = "dense_file_array";
+        } else if (m_index_type_name != "dense_file_array" && m_index_type_name != "sparse_file_array") {
+            throw argument_error{"The --index-file option only works with the index types 'dense_file_array' and 'sparse_file_array'."};
+        }
+    }
+
+    if (vm.count("two-pass")) {
+        m_two_pass = true;
+        if (vm["index-type"].defaulted() && m_index_file_name.empty()) {
+            m_index_type_name = "sparse_mem_array";
+        }
+    }
+
     setup_common(vm, desc);
     setup_progress(vm);
     setup_input_files(vm);
     setup_output_file(vm);
 
+    if (m_two_pass) {
+        for (const auto& file : m_input_files) {
+            if (file.filename().empty() || file.filename() == "-") {
+                throw argument_error{"Can not read from STDIN when using --two-pass."};
+            }
+        }
+    }
+
     if (vm.count("keep-untagged-nodes")) {
         m_keep_untagged_nodes = true;
     }
@@ -107,6 +144,15 @@ bool CommandAddLocationsToWays::setup(const std::vector<std::string>& arguments)
         m_ignore_missing_nodes = true;
     }
 
+    if (vm.count("threads")) {
+        m_num_threads = vm["threads"].as<unsigned int>();
+        if (m_num_threads == 0) {
+            throw argument_error{"The --threads option needs a value of at least 1."};
+        }
+    } else {
+        m_num_threads = default_num_threads();
+    }
+
     return true;
 }
 
@@ -116,14 +162,196 @@ void CommandAddLocationsToWays::show_arguments() {
 
     m_vout << "  other options:\n";
     m_vout << "    index type: " << m_index_type_name << '\n';
+    if (!m_index_file_name.empty()) {
+        m_vout << "    index file: " << m_index_file_name << '\n';
+    }
     m_vout << "    keep untagged nodes: " << yes_no(m_keep_untagged_nodes);
+    m_vout << "    threads: " << m_num_threads << '\n';
+    m_vout << "    two pass: " << yes_no(m_two_pass);
     m_vout << '\n';
 }
 
+namespace {
+
+    /**
+     *  The information stored in the ".info" file next to an index file.
+     *  It records which index type was used and where the locations came
+     *  from, so an index file can be reused safely later.
+     */
+    using index_info_type = std::map<std::string, std::string>;
+
+    std::string index_info_file_name(const std::string& index_file_name) {
+        return index_file_name + ".info";
+    }
+
+    bool file_exists(const std::string& file_name) {
+        return std::ifstream{file_name}.good();
+    }
+
+    index_info_type read_index_info(const std::string& index_file_name) {
+        index_info_type info;
+
+        std::ifstream file{index_info_file_name(index_file_name)};
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            const auto pos = line.find('=');
+            if (pos != std::string::npos) {
+                info[line.substr(0, pos)] = line.substr(pos + 1);
+            }
+        }
+
+        return info;
+    }
+
+    void write_index_info(const std::string& index_file_name, const index_info_type& info) {
+        std::ofstream file{index_info_file_name(index_file_name)};
+        file << "# osmium node location index\n";
+        for (const auto& entry : info) {
+            file << entry.first << '=' << entry.second << '\n';
+        }
+        if (!file) {
+            throw std::runtime_error{"Could not write '" + index_info_file_name(index_file_name) + "'"};
+        }
+    }
+
+    void add_replication_info(index_info_type& info, const osmium::io::Header& header) {
+        for (const char* key : {"osmosis_replication_sequence_number", "osmosis_replication_timestamp"}) {
+            const auto value = header.get(key);
+            if (!value.empty()) {
+                info[key] = value;
+            }
+        }
+    }
+
+    // Buffers with fewer ways than this are handled in the main thread.
+    constexpr const std::size_t min_ways_for_threads = 1000;
+
+    bool has_nodes(const osmium::memory::Buffer& buffer) {
+        const auto nodes = buffer.select<osmium::Node>();
+        return nodes.begin() != nodes.end();
+    }
+
+} // anonymous namespace
+
+/**
+ * Look up the node locations for all ways in a buffer without nodes.
+ * At this point all nodes are in the index and lookups are read-only, so
+ * the ways can be split up between several threads. The first way is
+ * always handled in the calling thread, because the location handler
+ * might have to sort the index first. The locations for the other ways
+ * are looked up in batches (see WayNodeLocations) using the thread pool
+ * which is started once and used for all buffers.
+ */
+void CommandAddLocationsToWays::add_locations_to_ways(osmium::memory::Buffer& buffer, location_handler_type& location_handler) {
+    std::vector<osmium::Way*> ways;
+    for (auto& way : buffer.select<osmium::Way>()) {
+        ways.push_back(&way);
+    }
+
+    if (ways.empty()) {
+        return;
+    }
+
+    location_handler.way(*ways.front());
+
+    if (m_num_threads <= 1 || ways.size() < min_ways_for_threads) {
+        set_way_node_locations(std::next(ways.begin()), ways.end(), location_handler, m_ignore_missing_nodes);
+        return;
+    }
+
+    // The ways are split up into m_num_threads slices. The first slice is
+    // handled in this thread, the others in the thread pool.
+    const std::size_t num_ways = ways.size() - 1;
+    const auto slice = [&](unsigned int i) {
+        return std::next(ways.begin(), static_cast<std::ptrdiff_t>(1 + num_ways * i / m_num_threads));
+    };
+
+    const bool ignore_errors = m_ignore_missing_nodes;
+    std::vector<std::future<void>> results;
+    for (unsigned int i = 1; i < m_num_threads; ++i) {
+        const auto first = slice(i);
+        const auto last = slice(i + 1);
+        results.push_back(m_pool->submit([first, last, &location_handler, ignore_errors]() {
+            set_way_node_locations(first, last, location_handler, ignore_errors);
+        }));
+    }
+
+    std::exception_ptr error;
+    try {
+        set_way_node_locations(slice(0), slice(1), location_handler, ignore_errors);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    // Wait for all threads before rethrowing any exception, because they
+    // use the ways vector.
+    for (auto& result : results) {
+        try {
+            result.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ * First pass of the --two-pass mode: Remember the IDs of all nodes
+ * referenced from any way.
+ */
+void CommandAddLocationsToWays::find_referenced_nodes() {
+    for (const auto& input_file : m_input_files) {
+        m_vout << "Reading ways from input file '" << input_file.filename() << "'\n";
+        osmium::io::Reader reader{input_file, osmium::osm_entity_bits::way};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            for (const auto& way : buffer.select<osmium::Way>()) {
+                for (const auto& node_ref : way.nodes()) {
+                    m_referenced_nodes.set(node_ref.positive_ref());
+                }
+            }
+        }
+        reader.close();
+    }
+    m_vout << "Found " << m_referenced_nodes.size() << " nodes referenced from ways.\n";
+}
+
+/**
+ * Like osmium::apply() with the location handler, but only nodes found
+ * in the first pass are added to the index.
+ */
+void CommandAddLocationsToWays::add_referenced_node_locations(osmium::memory::Buffer& buffer, location_handler_type& location_handler) {
+    for (auto& item : buffer) {
+        if (item.type() == osmium::item_type::node) {
+            auto& node = static_cast<osmium::Node&>(item);
+            if (m_referenced_nodes.get(node.positive_id())) {
+                location_handler.node(node);
+            }
+        } else if (item.type() == osmium::item_type::way) {
+            location_handler.way(static_cast<osmium::Way&>(item));
+        }
+    }
+}
+
 void CommandAddLocationsToWays::copy_data(osmium::ProgressBar& progress_bar, osmium::io::Reader& reader, osmium::io::Writer& writer, location_handler_type& location_handler) {
     while (osmium::memory::Buffer buffer = reader.read()) {
         progress_bar.update(reader.offset());
-        osmium::apply(buffer, location_handler);
+        if (has_nodes(buffer)) {
+            if (m_two_pass) {
+                add_referenced_node_locations(buffer, location_handler);
+            } else {
+                osmium::apply(buffer, location_handler);
+            }
+        } else {
+            add_locations_to_ways(buffer, location_handler);
+        }
 
         if (m_keep_untagged_nodes) {
             writer(std::move(buffer));
@@ -138,8 +366,42 @@ void CommandAddLocationsToWays::copy_data(osmium::ProgressBar& progress_bar, osm
 }
 
 bool CommandAddLocationsToWays::run() {
+    std::string index_config{m_index_type_name};
+    index_info_type index_info;
+
+    if (!m_index_file_name.empty()) {
+        index_config += ',';
+        index_config += m_index_file_name;
+
+        if (file_exists(m_index_file_name)) {
+            // The sparse index appends new locations to the file, after
+            // that it isn't sorted any more and lookups would fail.
+            if (m_index_type_name == "sparse_file_array") {
+                throw argument_error{"Index file '" + m_index_file_name + "' exists. Index files of type 'sparse_file_array' can not be reused."};
+            }
+            const auto old_info = read_index_info(m_index_file_name);
+            if (old_info.empty()) {
+                throw argument_error{"Index file '" + m_index_file_name + "' exists, but there is no '" + index_info_file_name(m_index_file_name) + "'. Can not reuse it."};
+            }
+            const auto it = old_info.find("index_type");
+            if (it == old_info.end() || it->second != m_index_type_name) {
+                throw argument_error{"Index file '" + m_index_file_name + "' was not created with index type '" + m_index_type_name + "'."};
+            }
+            m_vout << "Reusing node location index from '" << m_index_file_name << "':\n";
+            for (const auto& entry : old_info) {
+                m_vout << "  " << entry.first << ": " << entry.second << '\n';
+            }
+        }
+
+        index_info["index_type"] = m_index_type_name;
+    }
+
+    if (m_two_pass) {
+        find_referenced_nodes();
+    }
+
     const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
-    auto location_index = map_factory.create_map(m_index_type_name);
+    auto location_index = map_factory.create_map(index_config);
     location_handler_type location_handler{*location_index};
 
     if (m_ignore_missing_nodes) {
@@ -148,10 +410,15 @@ bool CommandAddLocationsToWays::run() {
 
     m_output_file.set("locations_on_ways");
 
+    if (m_num_threads > 1) {
+        m_pool.reset(new osmium::thread::Pool{static_cast<int>(m_num_threads - 1)});
+    }
+
     if (m_input_files.size() == 1) { // single input file
         m_vout << "Copying input file '" << m_input_files[0].filename() << "'\n";
         osmium::io::Reader reader{m_input_files[0]};
         osmium::io::Header header{reader.header()};
+        add_replication_info(index_info, header);
         setup_header(header);
         osmium::io::Writer writer(m_output_file, header, m_output_overwrite, m_fsync);
 
@@ -171,6 +438,7 @@ bool CommandAddLocationsToWays::run() {
             progress_bar.remove();
             m_vout << "Copying input file '" << input_file.filename() << "'\n";
             osmium::io::Reader reader(input_file);
+            add_replication_info(index_info, reader.header());
 
             copy_data(progress_bar, reader, writer, location_handler);
 
@@ -181,6 +449,20 @@ bool CommandAddLocationsToWays::run() {
         writer.close();
     }
 
+    if (!m_index_file_name.empty()) {
+        std::string sources;
+        for (const auto& input_file : m_input_files) {
+            if (!sources.empty()) {
+                sources += ' ';
+            }
+            sources += input_file.filename();
+        }
+        index_info["source"] = sources;
+
+        m_vout << "Writing index information to '" << index_info_file_name(m_index_file_name) << "'...\n";
+        write_index_info(m_index_file_name, index_info);
+    }
+
     m_vout << "About " << (location_index->used_memory() / (1024 * 1024)) << " MBytes used for node location index (in main memory or on disk).\n";
     show_memory_used();
     m_vout << "Done.\n";
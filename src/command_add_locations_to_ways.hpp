@@ -23,17 +23,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/index/id_set.hpp>
 #include <osmium/index/map/all.hpp>
+#include <osmium/thread/pool.hpp>
 
 namespace osmium {
     namespace io {
         class Reader;
         class Writer;
     }
+    namespace memory {
+        class Buffer;
+    }
     class ProgressBar;
 }
 
@@ -46,9 +52,22 @@ class CommandAddLocationsToWays : public Command, public with_multiple_osm_input
 
     void copy_data(osmium::ProgressBar& progress_bar, osmium::io::Reader& reader, osmium::io::Writer& writer, location_handler_type& location_handler);
 
+    void add_locations_to_ways(osmium::memory::Buffer& buffer, location_handler_type& location_handler);
+
+    void find_referenced_nodes();
+
+    void add_referenced_node_locations(osmium::memory::Buffer& buffer, location_handler_type& location_handler);
+
     std::string m_index_type_name;
+    std::string m_index_file_name;
     bool m_keep_untagged_nodes = false;
     bool m_ignore_missing_nodes = false;
+    unsigned int m_num_threads = 1;
+    bool m_two_pass = false;
+    osmium::index::IdSetDense<osmium::unsigned_object_id_type> m_referenced_nodes;
+
+    // Threads used for location lookups in addition to the main thread.
+    std::unique_ptr<osmium::thread::Pool> m_pool;
 
 public:
 
@@ -21,6 +21,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdlib>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -32,6 +34,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <osmium/index/id_set.hpp>
 #include <osmium/index/map/sparse_mem_array.hpp>
 #include <osmium/io/file.hpp>
+#include <osmium/io/file_format.hpp>
 #include <osmium/io/header.hpp>
 #include <osmium/io/input_iterator.hpp>
 #include <osmium/io/output_iterator.hpp>
@@ -49,7 +52,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "command_apply_changes.hpp"
 #include "exception.hpp"
+#include "external_sort.hpp"
+#include "pbf_blocks.hpp"
+#include "sort_keys.hpp"
 #include "util.hpp"
+#include "way_node_locations.hpp"
 
 using location_index_type = osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type, osmium::Location>;
 
@@ -61,6 +68,8 @@ bool CommandApplyChanges::setup(const std::vector<std::string>& arguments) {
     ("remove-deleted,r",  "Remove deleted objects from output (deprecated)")
     ("with-history,H",    "Apply changes to history file")
     ("locations-on-ways", "Expect and update locations on ways")
+    ("max-memory", po::value<std::size_t>(), "Maximum memory to use for change data in MBytes (default: unlimited)")
+    ("copy-blocks",       "Copy PBF blocks without changes unchanged")
     ;
 
     po::options_description opts_common{add_common_options()};
@@ -119,6 +128,28 @@ bool CommandApplyChanges::setup(const std::vector<std::string>& arguments) {
         }
     }
 
+    if (vm.count("max-memory")) {
+        if (m_locations_on_ways) {
+            throw argument_error{"Can not use --max-memory and --locations-on-ways together."};
+        }
+        const auto max_memory = vm["max-memory"].as<std::size_t>();
+        if (max_memory == 0) {
+            throw argument_error{"Value for --max-memory must be larger than 0."};
+        }
+        m_max_memory = max_memory * 1024 * 1024;
+    }
+
+    if (vm.count("copy-blocks")) {
+        if (m_locations_on_ways || m_max_memory > 0) {
+            throw argument_error{"Can not use --copy-blocks together with --locations-on-ways or --max-memory."};
+        }
+        if (m_input_file.format() != osmium::io::file_format::pbf ||
+            m_output_file.format() != osmium::io::file_format::pbf) {
+            throw argument_error{"The --copy-blocks option only works with PBF input and output files."};
+        }
+        m_copy_blocks = true;
+    }
+
     if (vm.count("simplify")) {
         warning("-s, --simplify option is deprecated. Please see manual page.\n");
         m_with_history = false;
@@ -143,6 +174,12 @@ void CommandApplyChanges::show_arguments() {
     show_output_arguments(m_vout);
     m_vout << "  reading and writing history file: " << yes_no(m_with_history);
     m_vout << "  locations on ways: " << yes_no(m_locations_on_ways);
+    m_vout << "  copy blocks: " << yes_no(m_copy_blocks);
+    if (m_max_memory == 0) {
+        m_vout << "  max memory: unlimited\n";
+    } else {
+        m_vout << "  max memory: " << (m_max_memory / (1024 * 1024)) << " MBytes\n";
+    }
 }
 
 namespace {
@@ -176,32 +213,313 @@ namespace {
 
     }; // class copy_first_with_id
 
+    /**
+     *  Merge the sorted changes with the sorted input like std::set_union
+     *  does. If an object is in both, the one from the changes is used.
+     */
+    template <typename TCompare, typename TOutput>
+    void merge_changes(RunMerger& changes, osmium::io::Reader& reader, TCompare compare, TOutput output) {
+        const auto input = osmium::io::make_input_iterator_range<osmium::OSMObject>(reader);
+        auto it = input.begin();
+        const auto end = input.end();
+
+        while (!changes.empty() || it != end) {
+            if (it == end || (!changes.empty() && !compare(*it, changes.get()))) {
+                if (it != end && !compare(changes.get(), *it)) {
+                    ++it;
+                }
+                output(changes.get());
+                changes.next();
+            } else {
+                output(*it);
+                ++it;
+            }
+        }
+    }
+
+    // Objects are encoded and written out when they take up this much
+    // space.
+    constexpr const std::size_t max_buffer_size = 10 * 1024 * 1024;
+
+    /**
+     *  Output for the --copy-blocks mode. Objects are collected in a buffer
+     *  which is encoded into PBF blocks when a block from the input file
+     *  is copied or the buffer is full. For normal data files only the
+     *  first version of each object is written, deleted objects are
+     *  removed.
+     */
+    class BlockOutput {
+
+        PBFBlockWriter* m_writer;
+        bool m_with_history;
+        osmium::memory::Buffer m_buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+        pbf_object_key m_last{osmium::item_type::undefined, 0};
+
+    public:
+
+        BlockOutput(PBFBlockWriter& writer, bool with_history) :
+            m_writer(&writer),
+            m_with_history(with_history) {
+        }
+
+        void write_header(const osmium::io::Header& header) {
+            m_writer->write_header(header);
+        }
+
+        void add(const osmium::OSMObject& object) {
+            if (!m_with_history) {
+                const pbf_object_key key{object.type(), object.id()};
+                if (key.type == m_last.type && key.id == m_last.id) {
+                    return;
+                }
+                m_last = key;
+                if (!object.visible()) {
+                    return;
+                }
+            }
+            m_buffer.add_item(object);
+            m_buffer.commit();
+            if (m_buffer.committed() >= max_buffer_size) {
+                flush();
+            }
+        }
+
+        void copy_block(const PBFBlock& block) {
+            flush();
+            m_writer->copy_block(block);
+            m_last = block.last();
+        }
+
+        void flush() {
+            if (m_buffer.committed() > 0) {
+                m_writer->write_objects(std::move(m_buffer));
+                m_buffer = osmium::memory::Buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+            }
+        }
+
+    }; // class BlockOutput
+
+    class add_to_block_output {
+
+        BlockOutput* output;
+
+    public:
+
+        explicit add_to_block_output(BlockOutput& o) :
+            output(&o) {
+        }
+
+        void operator()(const osmium::OSMObject& obj) {
+            output->add(obj);
+        }
+
+    }; // class add_to_block_output
+
+    pbf_object_key object_key(const osmium::OSMObject& object) noexcept {
+        return pbf_object_key{object.type(), object.id()};
+    }
+
+    // Maximum number of consecutive blocks with changes decoded together.
+    constexpr const std::size_t max_decoded_blocks = 64;
+
 } // anonymous namespace
 
-static void update_nodes_if_way(osmium::OSMObject& object, const location_index_type& location_index) {
-    if (object.type() != osmium::item_type::way) {
-        return;
+/**
+ * Set the locations of the nodes of all visible ways in the range of
+ * objects from the location index. Locations of nodes not in the index
+ * are left unchanged. The locations are looked up together, see
+ * WayNodeLocations.
+ */
+template <typename TIterator>
+static void update_way_node_locations(TIterator first, TIterator last, const location_index_type& location_index) {
+    WayNodeLocations node_locations;
+    for (; first != last; ++first) {
+        if (first->type() == osmium::item_type::way && first->visible()) {
+            node_locations.add(static_cast<osmium::Way&>(*first));
+        }
+    }
+
+    node_locations.set_locations([&location_index](osmium::object_id_type id) {
+        return location_index.get_noexcept(static_cast<osmium::unsigned_object_id_type>(std::abs(id)));
+    });
+}
+
+bool CommandApplyChanges::run_with_max_memory() {
+    // For history files the changes are sorted in the normal order. For
+    // normal data files the largest version of each object comes first
+    // and only this last version of any object is copied to the output.
+    const auto order = m_with_history ? sort_order::type_id_version
+                                      : sort_order::type_id_reverse_version;
+    ExternalSorter sorter{m_max_memory, default_num_threads(), order};
+
+    m_vout << "Reading change file contents and writing sorted runs to temporary files...\n";
+    for (const std::string& change_file_name : m_change_filenames) {
+        osmium::io::File file{change_file_name, m_change_file_format};
+        osmium::io::Reader reader{file, osmium::osm_entity_bits::object};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            sorter.add(buffer);
+        }
+        reader.close();
+    }
+    sorter.done();
+    m_vout << "Wrote " << sorter.num_runs() << " sorted runs ("
+           << sorter.num_presorted_runs() << " of them already sorted in the input).\n";
+
+    m_vout << "Opening input file...\n";
+    osmium::io::Reader reader{m_input_file, osmium::osm_entity_bits::object};
+
+    osmium::io::Header header;
+    setup_header(header);
+    if (m_with_history) {
+        header.set_has_multiple_object_versions(true);
+    }
+
+    m_vout << "Opening output file...\n";
+    osmium::io::Writer writer{m_output_file, header, m_output_overwrite, m_fsync};
+
+    m_vout << "Applying changes and writing them to output...\n";
+    RunMerger changes{sorter.runs(), order};
+    if (m_with_history) {
+        merge_changes(changes, reader, osmium::object_order_type_id_version{}, [&writer](const osmium::OSMObject& object) {
+            writer(object);
+        });
+    } else {
+        merge_changes(changes, reader, osmium::object_order_type_id_reverse_version{}, copy_first_with_id(writer));
+    }
+
+    writer.close();
+    reader.close();
+
+    show_memory_used();
+    m_vout << "Done.\n";
+
+    return true;
+}
+
+bool CommandApplyChanges::run_copy_blocks(osmium::ObjectPointerCollection& objects) {
+    m_vout << "Sorting change data...\n";
+    if (m_with_history) {
+        objects.sort(osmium::object_order_type_id_version{});
+    } else {
+        objects.sort(osmium::object_order_type_id_reverse_version{});
     }
 
-    for (auto& node_ref : static_cast<osmium::Way&>(object).nodes()) {
-        auto location = location_index.get_noexcept(node_ref.positive_ref());
-        if (location) {
-            node_ref.set_location(location);
+    m_vout << "Opening input file...\n";
+    PBFBlockReader reader{m_input_file.filename()};
+
+    osmium::io::Header header;
+    setup_header(header);
+    if (m_with_history) {
+        header.set_has_multiple_object_versions(true);
+    }
+
+    m_vout << "Opening output file...\n";
+    PBFBlockWriter writer{m_output_file, m_output_overwrite};
+    BlockOutput output{writer, m_with_history};
+    output.write_header(header);
+
+    m_vout << "Applying changes and writing them to output block by block...\n";
+    std::size_t blocks_copied = 0;
+    std::size_t blocks_decoded = 0;
+
+    auto it = objects.begin();
+    const auto end = objects.end();
+
+    // Returns the end of the changes that come before the key.
+    const auto changes_before = [&](const pbf_object_key& key) {
+        return std::partition_point(it, end, [&key](const osmium::OSMObject& object) {
+            return object_key(object) < key;
+        });
+    };
+
+    // Merges the objects in the blocks with all changes that come before
+    // the key (or all changes if there is no key).
+    std::vector<PBFBlock> blocks;
+    const auto decode_blocks = [&](const pbf_object_key* key) {
+        const auto changes_end = key ? changes_before(*key) : end;
+
+        std::vector<osmium::memory::Buffer> buffers;
+        osmium::ObjectPointerCollection input;
+        if (!blocks.empty()) {
+            buffers = decode_pbf_blocks(reader.header_block(), blocks);
+            for (auto& buffer : buffers) {
+                osmium::apply(buffer, input);
+            }
+            blocks_decoded += blocks.size();
+            blocks.clear();
         }
+
+        const auto output_it = boost::make_function_output_iterator(add_to_block_output(output));
+        if (m_with_history) {
+            std::set_union(it, changes_end, input.begin(), input.end(), output_it,
+                           osmium::object_order_type_id_version{});
+        } else {
+            std::set_union(it, changes_end, input.begin(), input.end(), output_it,
+                           osmium::object_order_type_id_reverse_version{});
+        }
+        it = changes_end;
+    };
+
+    PBFBlock block;
+    while (reader.read(block)) {
+        if (!block.has_objects()) {
+            continue;
+        }
+
+        const auto next_change = changes_before(block.first());
+        const bool has_changes = next_change != end && !(block.last() < object_key(*next_change));
+
+        if (has_changes) {
+            if (blocks.size() >= max_decoded_blocks) {
+                decode_blocks(&block.first());
+            }
+            blocks.push_back(std::move(block));
+            continue;
+        }
+
+        if (!blocks.empty()) {
+            decode_blocks(&block.first());
+        }
+
+        for (; it != next_change; ++it) {
+            output.add(*it);
+        }
+        output.copy_block(block);
+        ++blocks_copied;
     }
+
+    decode_blocks(nullptr);
+    output.flush();
+
+    m_vout << "Copied " << blocks_copied << " blocks unchanged, decoded "
+           << blocks_decoded << " blocks with changes.\n";
+
+    writer.close(m_fsync);
+
+    show_memory_used();
+    m_vout << "Done.\n";
+
+    return true;
 }
 
 bool CommandApplyChanges::run() {
+    for (const std::string& change_file_name : m_change_filenames) {
+        if (change_file_name == "-" && m_change_file_format.empty()) {
+            throw argument_error{"When reading the change file from STDIN you have to use\n"
+                                 "the --change-file-format option to specify the file format."};
+        }
+    }
+
+    if (m_max_memory > 0) {
+        return run_with_max_memory();
+    }
+
     std::vector<osmium::memory::Buffer> changes;
     osmium::ObjectPointerCollection objects;
 
     m_vout << "Reading change file contents...\n";
 
     for (const std::string& change_file_name : m_change_filenames) {
-        if (change_file_name == "-" && m_change_file_format.empty()) {
-            throw argument_error{"When reading the change file from STDIN you have to use\n"
-                                 "the --change-file-format option to specify the file format."};
-        }
         osmium::io::File file{change_file_name, m_change_file_format};
         osmium::io::Reader reader{file, osmium::osm_entity_bits::object};
         while (osmium::memory::Buffer buffer = reader.read()) {
@@ -211,6 +529,10 @@ bool CommandApplyChanges::run() {
         reader.close();
     }
 
+    if (m_copy_blocks) {
+        return run_copy_blocks(objects);
+    }
+
     m_vout << "Opening input file...\n";
     osmium::io::Reader reader{m_input_file, osmium::osm_entity_bits::object};
 
@@ -252,11 +574,16 @@ bool CommandApplyChanges::run() {
             objects.unique(osmium::object_equal_type_id{});
             m_vout << "There are " << objects.size() << " unique objects in the change files\n";
 
+            // Only the last version of each object is left in the change
+            // data now, so the location index gets the current location of
+            // all changed nodes. All ways from the input file are updated
+            // from this index while they are copied, so this also updates
+            // ways that are not changed themselves but contain moved nodes.
             osmium::index::IdSetSmall<osmium::unsigned_object_id_type> node_ids;
             m_vout << "Creating node index...\n";
-            for (const auto& buffer : changes) {
-                for (const auto& way : buffer.select<osmium::Way>()) {
-                    for (const auto& nr : way.nodes()) {
+            for (const auto& object : objects) {
+                if (object.type() == osmium::item_type::way) {
+                    for (const auto& nr : static_cast<const osmium::Way&>(object).nodes()) {
                         node_ids.set(nr.positive_ref());
                     }
                 }
@@ -264,37 +591,61 @@ bool CommandApplyChanges::run() {
             node_ids.sort_unique();
             m_vout << "Node index has " << node_ids.size() << " entries\n";
 
+            // The IDs of all nodes in the change data, deleted or not. The
+            // location index can't be used to find out whether a node was
+            // changed, because it is not sorted while nodes are added to it.
+            osmium::index::IdSetSmall<osmium::unsigned_object_id_type> changed_node_ids;
+
             m_vout << "Creating location index...\n";
             location_index_type location_index;
-            for (const auto& buffer : changes) {
-                for (const auto& node : buffer.select<osmium::Node>()) {
-                    location_index.set(node.positive_id(), node.location());
+            for (const auto& object : objects) {
+                if (object.type() == osmium::item_type::node) {
+                    changed_node_ids.set(object.positive_id());
+                    if (object.visible()) {
+                        location_index.set(object.positive_id(), static_cast<const osmium::Node&>(object).location());
+                    }
                 }
             }
+            changed_node_ids.sort_unique();
             m_vout << "Location index has " << location_index.size() << " entries\n";
 
             m_vout << "Applying changes and writing them to output...\n";
             auto it = objects.begin();
             auto last_type = osmium::item_type::undefined;
+            bool nodes_done = false;
+
+            // Called once all nodes are in the location index, which is
+            // before the first object that is not a node is written.
+            const auto finish_nodes = [&]() {
+                location_index.sort();
+                node_ids.clear();
+                changed_node_ids.clear();
+                update_way_node_locations(objects.begin(), objects.end(), location_index);
+                nodes_done = true;
+            };
+
             osmium::ProgressBar progress_bar{reader.file_size(), display_progress()};
             while (osmium::memory::Buffer buffer = reader.read()) {
                 progress_bar.update(reader.offset());
+                bool buffer_ways_done = false;
                 for (auto& object : buffer.select<osmium::OSMObject>()) {
                     if (object.type() < last_type) {
                         throw std::runtime_error{"Input data out of order. Need nodes, ways, relations in ID order."};
                     }
                     if (object.type() == osmium::item_type::node) {
                         const auto& node = static_cast<osmium::Node&>(object);
-                        if (node_ids.get_binary_search(node.positive_id())) {
-                            const auto location = location_index.get_noexcept(node.positive_id());
-                            if (!location) {
-                                location_index.set(node.positive_id(), node.location());
-                            }
+                        if (node_ids.get_binary_search(node.positive_id()) &&
+                            !changed_node_ids.get_binary_search(node.positive_id())) {
+                            location_index.set(node.positive_id(), node.location());
                         }
-                    } else if (object.type() == osmium::item_type::way) {
-                        if (last_type == osmium::item_type::node) {
-                            location_index.sort();
-                            node_ids.clear();
+                    } else {
+                        if (!nodes_done) {
+                            finish_nodes();
+                        }
+                        if (object.type() == osmium::item_type::way && !buffer_ways_done) {
+                            auto buffer_objects = buffer.select<osmium::OSMObject>();
+                            update_way_node_locations(buffer_objects.begin(), buffer_objects.end(), location_index);
+                            buffer_ways_done = true;
                         }
                     }
 
@@ -303,7 +654,6 @@ bool CommandApplyChanges::run() {
                     auto last_it = it;
                     while (it != objects.end() && osmium::object_order_type_id_reverse_version{}(*it, object)) {
                         if (it->visible()) {
-                            update_nodes_if_way(*it, location_index);
                             writer(*it);
                         }
                         last_it = it;
@@ -311,14 +661,15 @@ bool CommandApplyChanges::run() {
                     }
 
                     if (last_it == objects.end() || last_it->type() != object.type() || last_it->id() != object.id()) {
-                        update_nodes_if_way(object, location_index);
                         writer(object);
                     }
                 }
             }
+            if (!nodes_done) {
+                finish_nodes();
+            }
             while (it != objects.end()) {
                 if (it->visible()) {
-                    update_nodes_if_way(*it, location_index);
                     writer(*it);
                 }
                 ++it;
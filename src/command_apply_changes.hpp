@@ -23,19 +23,31 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
 #include "cmd.hpp" // IWYU pragma: export
 
+namespace osmium {
+    class ObjectPointerCollection;
+}
+
 class CommandApplyChanges : public Command, public with_single_osm_input, public with_osm_output {
 
     std::vector<std::string> m_change_filenames;
 
     std::string m_change_file_format;
 
+    std::size_t m_max_memory = 0;
+
     bool m_with_history = false;
     bool m_locations_on_ways = false;
+    bool m_copy_blocks = false;
+
+    bool run_with_max_memory();
+
+    bool run_copy_blocks(osmium::ObjectPointerCollection& objects);
 
 public:
 
@@ -47,6 +47,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "command_export.hpp"
 #include "exception.hpp"
 #include "util.hpp"
+#include "way_node_locations.hpp"
 
 #include "export/export_handler.hpp"
 #include "export/export_format_json.hpp"
@@ -405,10 +406,18 @@ bool CommandExport::run() {
         location_handler_type location_handler{*location_index};
         location_handler.ignore_errors();
 
-        osmium::io::Reader reader{m_input_filename};
-        osmium::apply(reader, check_order_handler, location_handler, export_handler, mp_manager.handler([&export_handler](osmium::memory::Buffer&& buffer) {
+        auto mp_handler = mp_manager.handler([&export_handler](osmium::memory::Buffer&& buffer) {
             osmium::apply(buffer, export_handler);
-        }));
+        });
+
+        osmium::io::Reader reader{m_input_filename};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            apply_location_handler(buffer, location_handler, true);
+            for (auto& item : buffer) {
+                osmium::apply_item(item, check_order_handler, export_handler, mp_handler);
+            }
+        }
+        mp_handler.flush();
         reader.close();
         m_vout << "About " << (location_index->used_memory() / (1024 * 1024)) << " MBytes used for node location index (in main memory or on disk).\n";
     }
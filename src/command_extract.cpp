@@ -20,9 +20,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <vector>
@@ -268,6 +270,19 @@ void CommandExtract::parse_config_file() {
             }
 
             Extract& extract = *m_extracts.back();
+
+            const std::string parent{get_value_as_string(e, "parent")};
+            if (!parent.empty()) {
+                const auto last = std::prev(m_extracts.end());
+                const auto it = std::find_if(m_extracts.begin(), last, [&](const std::unique_ptr<Extract>& other) {
+                    return other->output() == m_output_directory + parent;
+                });
+                if (it == last) {
+                    throw config_error{"Parent extract '" + parent + "' not found. It must come before this extract in the config file."};
+                }
+                extract.set_parent(it->get());
+            }
+
             const auto json_output_header = e.FindMember("output_header");
             if (json_output_header != e.MemberEnd()) {
                 const auto& value = json_output_header->value;
@@ -343,6 +358,7 @@ bool CommandExtract::setup(const std::vector<std::string>& arguments) {
     ("option,S", po::value<std::vector<std::string>>(), "Set strategy option")
     ("polygon,p", po::value<std::string>(), "Polygon file")
     ("strategy,s", po::value<std::string>()->default_value("complete_ways"), "Use named extract strategy")
+    ("threads", po::value<unsigned int>(), "Number of threads to use for the extracts (default: number of CPUs)")
     ("with-history,H", "Input file and output files are history files")
     ("set-bounds", "Sets bounds (bounding box) in header")
     ;
@@ -430,6 +446,15 @@ bool CommandExtract::setup(const std::vector<std::string>& arguments) {
         m_strategy_name = vm["strategy"].as<std::string>();
     }
 
+    if (vm.count("threads")) {
+        m_num_threads = vm["threads"].as<unsigned int>();
+        if (m_num_threads == 0) {
+            throw argument_error{"The --threads option needs a value of at least 1."};
+        }
+    } else {
+        m_num_threads = default_num_threads();
+    }
+
     return true;
 }
 
@@ -440,6 +465,7 @@ void CommandExtract::show_arguments() {
     m_vout << "  strategy options:\n";
     m_vout << "    strategy: " << m_strategy_name << '\n';
     m_vout << "    with history: " << yes_no(m_with_history);
+    m_vout << "    threads: " << m_num_threads << '\n';
 
     m_vout << "  other options:\n";
     m_vout << "    config file: " << m_config_file_name << '\n';
@@ -459,6 +485,9 @@ void CommandExtract::show_extracts() {
         std::cerr.fill(old_fill);
         m_vout << "     Format:      " << e->output_format()    << '\n';
         m_vout << "     Description: " << e->description()      << '\n';
+        if (e->parent()) {
+            m_vout << "     Parent:      " << e->parent()->output() << '\n';
+        }
         if (!e->header_options().empty()) {
             m_vout << "     Header opts: ";
             bool first = true;
@@ -494,11 +523,15 @@ bool CommandExtract::run() {
     show_extracts();
 
     m_strategy = make_strategy(m_strategy_name);
+    m_strategy->set_num_threads(m_num_threads);
     m_strategy->show_arguments(m_vout);
 
     osmium::io::Header header;
     setup_header(header);
 
+    const auto num_writer_threads = std::max(1U, std::min(m_num_threads, static_cast<unsigned int>(m_extracts.size())));
+    m_writer_threads.reset(new WriterThreads{num_writer_threads});
+
     for (const auto& extract : m_extracts) {
         osmium::io::Header file_header{header};
         if (m_with_history) {
@@ -510,7 +543,7 @@ bool CommandExtract::run() {
         for (const auto& p : extract->header_options()) {
             file_header.set(p.first, p.second);
         }
-        extract->open_file(file_header, m_output_overwrite, m_fsync);
+        extract->open_file(file_header, m_output_overwrite, m_fsync, m_writer_threads.get());
     }
 
     m_strategy->run(m_vout, display_progress(), m_input_file);
@@ -518,6 +551,12 @@ bool CommandExtract::run() {
     for (const auto& extract : m_extracts) {
         extract->close_file();
     }
+    m_writer_threads->finish();
+
+    m_vout << "Wrote " << m_writer_threads->buffers_written() << " buffers in "
+           << num_writer_threads << " writer threads (max queue depth: "
+           << m_writer_threads->max_queue_depth() << ", waited for writers: "
+           << static_cast<unsigned long>(m_writer_threads->stall_seconds() * 1000) << " ms).\n";
 
     show_memory_used();
 
@@ -34,6 +34,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "cmd.hpp" // IWYU pragma: export
 #include "extract/extract.hpp"
 #include "extract/strategy.hpp"
+#include "extract/writer_threads.hpp"
 
 class CommandExtract : public Command, public with_single_osm_input, public with_osm_output {
 
@@ -46,7 +47,9 @@ class CommandExtract : public Command, public with_single_osm_input, public with
     std::string m_strategy_name;
     std::unique_ptr<ExtractStrategy> m_strategy;
     std::vector<std::unique_ptr<Extract>> m_extracts;
+    std::unique_ptr<WriterThreads> m_writer_threads;
     osmium::memory::Buffer m_buffer{initial_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+    unsigned int m_num_threads = 1;
     bool m_with_history = false;
     bool m_set_bounds = false;
 
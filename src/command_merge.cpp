@@ -21,14 +21,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
 #include <string>
 #include <vector>
 #include <utility>
 
 #include <boost/program_options.hpp>
 
+#include <osmium/io/file.hpp>
+#include <osmium/io/file_format.hpp>
 #include <osmium/io/header.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
@@ -40,13 +44,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <osmium/util/verbose_output.hpp>
 
 #include "command_merge.hpp"
-
-namespace osmium { namespace io {
-    class File;
-}}
+#include "exception.hpp"
+#include "loser_tree.hpp"
+#include "pbf_blocks.hpp"
+#include "util.hpp"
 
 bool CommandMerge::setup(const std::vector<std::string>& arguments) {
     po::options_description opts_cmd{"COMMAND OPTIONS"};
+    opts_cmd.add_options()
+    ("copy-blocks", "Copy PBF blocks that don't overlap other inputs unchanged")
+    ;
 
     po::options_description opts_common{add_common_options()};
     po::options_description opts_input{add_multiple_inputs_options()};
@@ -74,82 +81,326 @@ bool CommandMerge::setup(const std::vector<std::string>& arguments) {
     setup_input_files(vm);
     setup_output_file(vm);
 
+    if (vm.count("copy-blocks")) {
+        m_copy_blocks = true;
+        for (const auto& file : m_input_files) {
+            if (file.format() != osmium::io::file_format::pbf) {
+                throw argument_error{"The --copy-blocks option only works with PBF input files."};
+            }
+        }
+        if (m_output_file.format() != osmium::io::file_format::pbf) {
+            throw argument_error{"The --copy-blocks option only works with PBF output files."};
+        }
+    }
+
     return true;
 }
 
 void CommandMerge::show_arguments() {
     show_multiple_inputs_arguments(m_vout);
     show_output_arguments(m_vout);
+
+    m_vout << "  other options:\n";
+    m_vout << "    copy blocks: " << yes_no(m_copy_blocks);
 }
 
 namespace {
 
+    /**
+     * Reads the objects from one input file buffer by buffer. The
+     * previous buffer is kept alive, so the object returned by get() stays
+     * valid after one call to next().
+     */
     class DataSource {
 
-        using it_type = osmium::io::InputIterator<osmium::io::Reader, osmium::OSMObject>;
-
-        std::unique_ptr<osmium::io::Reader> reader;
-        it_type iterator;
+        using iterator = osmium::memory::Buffer::t_iterator<osmium::OSMObject>;
+
+        std::unique_ptr<osmium::io::Reader> m_reader;
+        osmium::memory::Buffer m_buffer;
+        osmium::memory::Buffer m_previous_buffer;
+        iterator m_it;
+        iterator m_end;
+        bool m_empty = false;
+
+        void read_buffer() {
+            m_previous_buffer = std::move(m_buffer);
+            while (true) {
+                m_buffer = m_reader->read();
+                if (!m_buffer) {
+                    m_empty = true;
+                    return;
+                }
+                m_it = m_buffer.begin<osmium::OSMObject>();
+                m_end = m_buffer.end<osmium::OSMObject>();
+                if (m_it != m_end) {
+                    return;
+                }
+            }
+        }
 
     public:
 
         explicit DataSource(const osmium::io::File& file) :
-            reader(new osmium::io::Reader{file}),
-            iterator(*reader) {
+            m_reader(new osmium::io::Reader{file, osmium::osm_entity_bits::object}) {
+            read_buffer();
         }
 
         bool empty() const noexcept {
-            return iterator == it_type{};
+            return m_empty;
         }
 
-        bool next() noexcept {
-            ++iterator;
-            return iterator != it_type{};
+        void next() {
+            ++m_it;
+            if (m_it == m_end) {
+                read_buffer();
+            }
         }
 
-        const osmium::OSMObject* get() noexcept {
-            return &*iterator;
+        const osmium::OSMObject& get() const noexcept {
+            return *m_it;
         }
 
     }; // DataSource
 
-    class QueueElement {
+    /**
+     * Reads the PBF data blocks containing OSM objects from one input
+     * file.
+     */
+    class BlockSource {
 
-        const osmium::OSMObject* m_object;
-        int m_data_source_index;
+        PBFBlockReader m_reader;
+        PBFBlock m_block;
+        bool m_empty = false;
 
     public:
 
-        QueueElement(const osmium::OSMObject* object, int data_source_index) noexcept :
-            m_object(object),
-            m_data_source_index(data_source_index) {
+        explicit BlockSource(const std::string& filename) :
+            m_reader(filename) {
+            next();
+        }
+
+        const std::string& header_block() const noexcept {
+            return m_reader.header_block();
         }
 
-        const osmium::OSMObject& object() const noexcept {
-            return *m_object;
+        bool empty() const noexcept {
+            return m_empty;
         }
 
-        int data_source_index() const noexcept {
-            return m_data_source_index;
+        const PBFBlock& get() const noexcept {
+            return m_block;
         }
 
-    }; // QueueElement
+        void next() {
+            do {
+                if (!m_reader.read(m_block)) {
+                    m_empty = true;
+                    return;
+                }
+            } while (!m_block.has_objects());
+        }
 
-    bool operator<(const QueueElement& lhs, const QueueElement& rhs) noexcept {
-        return lhs.object() > rhs.object();
-    }
+        PBFBlock take() {
+            PBFBlock block{std::move(m_block)};
+            next();
+            return block;
+        }
+
+    }; // BlockSource
+
+    /**
+     * The objects from the decoded blocks of one input file that have not
+     * been written out yet. Decoded buffers are added at the end and
+     * dropped from the front once all their objects were used.
+     */
+    class DecodedObjects {
+
+        using iterator = osmium::memory::Buffer::t_iterator<osmium::OSMObject>;
+
+        std::deque<osmium::memory::Buffer> m_buffers;
+        iterator m_it;
+        iterator m_end;
 
-    bool operator==(const QueueElement& lhs, const QueueElement& rhs) noexcept {
-        return lhs.object() == rhs.object();
+        void skip_used_buffers() {
+            while (m_it == m_end && !m_buffers.empty()) {
+                m_buffers.pop_front();
+                if (!m_buffers.empty()) {
+                    m_it = m_buffers.front().begin<osmium::OSMObject>();
+                    m_end = m_buffers.front().end<osmium::OSMObject>();
+                }
+            }
+        }
+
+    public:
+
+        void add(std::vector<osmium::memory::Buffer>&& buffers) {
+            const bool was_empty = empty();
+            for (auto& buffer : buffers) {
+                m_buffers.push_back(std::move(buffer));
+            }
+            if (was_empty && !m_buffers.empty()) {
+                m_it = m_buffers.front().begin<osmium::OSMObject>();
+                m_end = m_buffers.front().end<osmium::OSMObject>();
+                skip_used_buffers();
+            }
+        }
+
+        bool empty() const noexcept {
+            return m_buffers.empty();
+        }
+
+        void next() {
+            ++m_it;
+            skip_used_buffers();
+        }
+
+        const osmium::OSMObject& get() const noexcept {
+            return *m_it;
+        }
+
+    }; // DecodedObjects
+
+    // Objects merged from overlapping blocks are encoded and written out
+    // when they take up this much space.
+    constexpr const std::size_t max_pending_size = 10 * 1024 * 1024;
+
+} // anonymous namespace
+
+bool CommandMerge::run_copy_blocks() {
+    m_vout << "Opening input files...\n";
+    std::vector<BlockSource> sources;
+    sources.reserve(m_input_files.size());
+    for (const osmium::io::File& file : m_input_files) {
+        sources.emplace_back(file.filename());
     }
 
-    bool operator!=(const QueueElement& lhs, const QueueElement& rhs) noexcept {
-        return ! (lhs == rhs);
+    m_vout << "Opening output file...\n";
+    osmium::io::Header header;
+    setup_header(header);
+
+    PBFBlockWriter writer{m_output_file, m_output_overwrite};
+    writer.write_header(header);
+
+    m_vout << "Merging " << m_input_files.size() << " input files to output file block by block...\n";
+    std::size_t blocks_copied = 0;
+    std::size_t blocks_decoded = 0;
+
+    osmium::memory::Buffer pending{max_pending_size, osmium::memory::Buffer::auto_grow::yes};
+    const auto write_pending = [&]() {
+        if (pending.committed() > 0) {
+            writer.write_objects(std::move(pending));
+            pending = osmium::memory::Buffer{max_pending_size, osmium::memory::Buffer::auto_grow::yes};
+        }
+    };
+
+    // The source with the block with the smallest first object.
+    const auto smallest_block = [&]() {
+        std::size_t first = sources.size();
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (!sources[i].empty() && (first == sources.size() || sources[i].get().first() < sources[first].get().first())) {
+                first = i;
+            }
+        }
+        return first;
+    };
+
+    std::vector<DecodedObjects> decoded(sources.size());
+    const auto all_decoded_written = [&]() {
+        return std::all_of(decoded.cbegin(), decoded.cend(), [](const DecodedObjects& d) {
+            return d.empty();
+        });
+    };
+
+    while (true) {
+        std::size_t first = smallest_block();
+
+        if (all_decoded_written()) {
+            if (first == sources.size()) {
+                break;
+            }
+
+            const pbf_object_key& max = sources[first].get().last();
+
+            bool overlaps = false;
+            for (std::size_t i = 0; i < sources.size(); ++i) {
+                if (i != first && !sources[i].empty() && !(max < sources[i].get().first())) {
+                    overlaps = true;
+                }
+            }
+
+            if (!overlaps) {
+                write_pending();
+                writer.copy_block(sources[first].get());
+                sources[first].next();
+                ++blocks_copied;
+                continue;
+            }
+        }
+
+        // Decode the block with the smallest first object. All objects in
+        // blocks not decoded yet come after the first object of the next
+        // block, so decoded objects before that can be merged and written
+        // out. This way only a few blocks per input file are kept in
+        // memory, even if the input files overlap completely.
+        if (first != sources.size()) {
+            std::vector<PBFBlock> blocks;
+            blocks.push_back(sources[first].take());
+            decoded[first].add(decode_pbf_blocks(sources[first].header_block(), blocks));
+            ++blocks_decoded;
+            first = smallest_block();
+        }
+
+        while (true) {
+            std::size_t smallest = decoded.size();
+            for (std::size_t i = 0; i < decoded.size(); ++i) {
+                if (!decoded[i].empty() && (smallest == decoded.size() || decoded[i].get() < decoded[smallest].get())) {
+                    smallest = i;
+                }
+            }
+            if (smallest == decoded.size()) {
+                break;
+            }
+
+            const osmium::OSMObject& object = decoded[smallest].get();
+            if (first != sources.size() && !(pbf_object_key{object.type(), object.id()} < sources[first].get().first())) {
+                break;
+            }
+
+            pending.add_item(object);
+            pending.commit();
+
+            // Skip the same object in the other input files.
+            for (std::size_t i = 0; i < decoded.size(); ++i) {
+                if (i != smallest && !decoded[i].empty() && decoded[i].get() == object) {
+                    decoded[i].next();
+                }
+            }
+            decoded[smallest].next();
+
+            if (pending.committed() >= max_pending_size) {
+                write_pending();
+            }
+        }
     }
+    write_pending();
 
-} // anonymous namespace
+    m_vout << "Copied " << blocks_copied << " blocks unchanged, decoded "
+           << blocks_decoded << " overlapping blocks.\n";
+
+    m_vout << "Closing output file...\n";
+    writer.close(m_fsync);
+
+    show_memory_used();
+    m_vout << "Done.\n";
+
+    return true;
+}
 
 bool CommandMerge::run() {
+    if (m_copy_blocks) {
+        return run_copy_blocks();
+    }
+
     m_vout << "Opening output file...\n";
     osmium::io::Header header;
     setup_header(header);
@@ -180,29 +431,17 @@ bool CommandMerge::run() {
         std::vector<DataSource> data_sources;
         data_sources.reserve(m_input_files.size());
 
-        std::priority_queue<QueueElement> queue;
-
-        int index = 0;
         for (const osmium::io::File& file : m_input_files) {
             data_sources.emplace_back(file);
-
-            if (!data_sources.back().empty()) {
-                queue.emplace(data_sources.back().get(), index);
-            }
-
-            ++index;
         }
 
-        while (!queue.empty()) {
-            auto element = queue.top();
-            queue.pop();
-            if (queue.empty() || element != queue.top()) {
-                writer(element.object());
-            }
+        LoserTree<DataSource, std::less<osmium::OSMObject>> tree{data_sources};
 
-            const int index = element.data_source_index();
-            if (data_sources[index].next()) {
-                queue.emplace(data_sources[index].get(), index);
+        while (!tree.empty()) {
+            const osmium::OSMObject& object = tree.get();
+            tree.next();
+            if (tree.empty() || object != tree.get()) {
+                writer(object);
             }
         }
     }
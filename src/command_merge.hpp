@@ -30,6 +30,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 class CommandMerge : public Command, public with_multiple_osm_inputs, public with_osm_output {
 
+    bool m_copy_blocks = false;
+
+    bool run_copy_blocks();
+
 public:
 
     CommandMerge() = default;
@@ -20,7 +20,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,17 +27,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <boost/program_options.hpp>
 
 #include <osmium/io/header.hpp>
-#include <osmium/io/output_iterator.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
 #include <osmium/memory/buffer.hpp>
-#include <osmium/object_pointer_collection.hpp>
 #include <osmium/osm/entity_bits.hpp>
-#include <osmium/osm/object_comparisons.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
 
 #include "command_merge_changes.hpp"
+#include "sort_keys.hpp"
 
 namespace osmium { namespace io {
     class File;
@@ -94,15 +91,15 @@ bool CommandMergeChanges::run() {
     setup_header(header);
 
     osmium::io::Writer writer{m_output_file, header, m_output_overwrite, m_fsync};
-    auto out = osmium::io::make_output_iterator(writer);
 
     // this will contain all the buffers with the input data
     std::vector<osmium::memory::Buffer> changes;
 
-    osmium::ObjectPointerCollection objects;
+    SortKeyCollection objects{m_simplify_change ? sort_order::type_id_reverse_version
+                                                : sort_order::type_id_version};
 
-    // read all input files, keep the buffers around and add pointer
-    // to each object to objects collection.
+    // read all input files, keep the buffers around and add a sort key
+    // for each object to objects collection.
     m_vout << "Reading change file contents...\n";
     for (osmium::io::File& change_file : m_input_files) {
         osmium::io::Reader reader{change_file, osmium::osm_entity_bits::object};
@@ -120,16 +117,19 @@ bool CommandMergeChanges::run() {
         // largest version of each object first and then only
         // copy this last version of any object to the output_buffer.
         m_vout << "Sorting change data...\n";
-        objects.sort(osmium::object_order_type_id_reverse_version());
+        objects.sort();
+        objects.unique();
         m_vout << "Writing last version of each object to output...\n";
-        std::unique_copy(objects.cbegin(), objects.cend(), out, osmium::object_equal_type_id());
     } else {
         // If the --simplify option was not given, this
         // is a straightforward sort and copy.
         m_vout << "Sorting change data...\n";
-        objects.sort(osmium::object_order_type_id_version());
+        objects.sort();
         m_vout << "Writing all objects to output...\n";
-        std::copy(objects.cbegin(), objects.cend(), out);
+    }
+
+    for (const auto& key : objects) {
+        writer(*key.object);
     }
 
     m_vout << "Closing output file...\n";
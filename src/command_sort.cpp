@@ -20,7 +20,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,20 +29,27 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <boost/program_options.hpp>
 
 #include <osmium/io/header.hpp>
-#include <osmium/io/output_iterator.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
 #include <osmium/memory/buffer.hpp>
-#include <osmium/object_pointer_collection.hpp>
 #include <osmium/osm/box.hpp>
 #include <osmium/osm/entity_bits.hpp>
-#include <osmium/osm/object_comparisons.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
 
 #include "command_sort.hpp"
+#include "exception.hpp"
+#include "external_sort.hpp"
+#include "sort_keys.hpp"
+#include "util.hpp"
 
 bool CommandSort::setup(const std::vector<std::string>& arguments) {
+    po::options_description opts_cmd{"COMMAND OPTIONS"};
+    opts_cmd.add_options()
+    ("max-memory", po::value<std::size_t>(), "Maximum memory to use for data in MBytes (default: unlimited)")
+    ("threads", po::value<unsigned int>(), "Number of threads to use for sorting (default: number of CPUs)")
+    ;
+
     po::options_description opts_common{add_common_options()};
     po::options_description opts_input{add_multiple_inputs_options()};
     po::options_description opts_output{add_output_options()};
@@ -52,7 +60,7 @@ bool CommandSort::setup(const std::vector<std::string>& arguments) {
     ;
 
     po::options_description desc;
-    desc.add(opts_common).add(opts_input).add(opts_output);
+    desc.add(opts_cmd).add(opts_common).add(opts_input).add(opts_output);
 
     po::options_description parsed_options;
     parsed_options.add(desc).add(hidden);
@@ -72,17 +80,52 @@ bool CommandSort::setup(const std::vector<std::string>& arguments) {
         m_filenames = vm["input-filenames"].as<std::vector<std::string>>();
     }
 
+    if (vm.count("max-memory")) {
+        m_max_memory = vm["max-memory"].as<std::size_t>() * 1024 * 1024;
+        if (m_max_memory == 0) {
+            throw argument_error{"The --max-memory option needs a value of at least 1 (MBytes)."};
+        }
+    }
+
+    if (vm.count("threads")) {
+        m_num_threads = vm["threads"].as<unsigned int>();
+        if (m_num_threads == 0) {
+            throw argument_error{"The --threads option needs a value of at least 1."};
+        }
+    } else {
+        m_num_threads = default_num_threads();
+    }
+
     return true;
 }
 
 void CommandSort::show_arguments() {
     show_multiple_inputs_arguments(m_vout);
     show_output_arguments(m_vout);
+
+    m_vout << "  other options:\n";
+    if (m_max_memory == 0) {
+        m_vout << "    max memory: unlimited\n";
+    } else {
+        m_vout << "    max memory: " << (m_max_memory / (1024 * 1024)) << " MBytes\n";
+    }
+    m_vout << "    threads: " << m_num_threads << '\n';
+}
+
+static double seconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
 }
 
 bool CommandSort::run() {
+    if (m_max_memory > 0) {
+        return run_with_max_memory();
+    }
+    return run_in_memory();
+}
+
+bool CommandSort::run_in_memory() {
     std::vector<osmium::memory::Buffer> data;
-    osmium::ObjectPointerCollection objects;
+    SortKeyCollection objects{sort_order::type_id_version};
 
     osmium::Box bounding_box;
 
@@ -108,11 +151,61 @@ bool CommandSort::run() {
     osmium::io::Writer writer{m_output_file, header, m_output_overwrite, m_fsync};
 
     m_vout << "Sorting data...\n";
-    objects.sort(osmium::object_order_type_id_version());
+    const auto start = std::chrono::steady_clock::now();
+    objects.sort(m_num_threads);
+    m_vout << "Sorting " << objects.size() << " objects took " << seconds(std::chrono::steady_clock::now() - start)
+           << " seconds (using " << m_num_threads << " threads).\n";
 
     m_vout << "Writing out sorted data...\n";
-    auto out = osmium::io::make_output_iterator(writer);
-    std::copy(objects.begin(), objects.end(), out);
+    for (const auto& key : objects) {
+        writer(*key.object);
+    }
+
+    m_vout << "Closing output file...\n";
+    writer.close();
+
+    show_memory_used();
+    m_vout << "Done.\n";
+
+    return true;
+}
+
+bool CommandSort::run_with_max_memory() {
+    ExternalSorter sorter{m_max_memory, m_num_threads};
+
+    osmium::Box bounding_box;
+
+    m_vout << "Reading contents of input files and writing sorted runs to temporary files...\n";
+    for (const std::string& file_name : m_filenames) {
+        osmium::io::Reader reader{file_name, osmium::osm_entity_bits::object};
+        osmium::io::Header header{reader.header()};
+        bounding_box.extend(header.joined_boxes());
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            sorter.add(buffer);
+        }
+        reader.close();
+    }
+    sorter.done();
+    m_vout << "Wrote " << sorter.num_runs() << " sorted runs ("
+           << sorter.num_presorted_runs() << " of them already sorted in the input).\n";
+    m_vout << "Sorting the runs took " << seconds(sorter.sort_duration())
+           << " seconds (using " << m_num_threads << " threads).\n";
+
+    m_vout << "Opening output file...\n";
+    osmium::io::Header header;
+    setup_header(header);
+    if (bounding_box) {
+        header.add_box(bounding_box);
+    }
+
+    osmium::io::Writer writer{m_output_file, header, m_output_overwrite, m_fsync};
+
+    m_vout << "Merging sorted runs and writing out data...\n";
+    RunMerger merger{sorter.runs()};
+    while (!merger.empty()) {
+        writer(merger.get());
+        merger.next();
+    }
 
     m_vout << "Closing output file...\n";
     writer.close();
@@ -23,6 +23,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -32,6 +33,14 @@ class CommandSort : public Command, public with_multiple_osm_inputs, public with
 
     std::vector<std::string> m_filenames;
 
+    std::size_t m_max_memory = 0;
+
+    unsigned int m_num_threads = 1;
+
+    bool run_in_memory();
+
+    bool run_with_max_memory();
+
 public:
 
     CommandSort() = default;
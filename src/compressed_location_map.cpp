@@ -0,0 +1,222 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "compressed_location_map.hpp"
+
+namespace {
+
+    inline void write_varint(std::vector<unsigned char>& data, std::uint64_t value) {
+        while (value >= 0x80U) {
+            data.push_back(static_cast<unsigned char>((value & 0x7fU) | 0x80U));
+            value >>= 7U;
+        }
+        data.push_back(static_cast<unsigned char>(value));
+    }
+
+    inline std::uint64_t read_varint(const unsigned char*& data) noexcept {
+        std::uint64_t value = 0;
+        unsigned int shift = 0;
+        while (*data & 0x80U) {
+            value |= static_cast<std::uint64_t>(*data++ & 0x7fU) << shift;
+            shift += 7;
+        }
+        value |= static_cast<std::uint64_t>(*data++) << shift;
+        return value;
+    }
+
+    inline std::uint64_t zigzag(std::int64_t value) noexcept {
+        return (static_cast<std::uint64_t>(value) << 1U) ^ static_cast<std::uint64_t>(value >> 63);
+    }
+
+    inline std::int64_t unzigzag(std::uint64_t value) noexcept {
+        return static_cast<std::int64_t>(value >> 1U) ^ -static_cast<std::int64_t>(value & 1U);
+    }
+
+    inline bool bit_set(const std::uint64_t* bitmap, std::size_t pos) noexcept {
+        return (bitmap[pos / 64] >> (pos % 64)) & 1U;
+    }
+
+    // The number of bits set in the bitmap before position pos.
+    inline std::size_t bits_before(const std::uint64_t* bitmap, std::size_t pos) noexcept {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < pos / 64; ++i) {
+            count += std::bitset<64>(bitmap[i]).count();
+        }
+        if (pos % 64) {
+            count += std::bitset<64>(bitmap[pos / 64] << (64 - pos % 64)).count();
+        }
+        return count;
+    }
+
+    const bool registered_compressed_location_map = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance().register_map("compressed_mem", [](const std::vector<std::string>& /* config */) {
+        return new CompressedLocationMap{};
+    });
+
+    inline bool get_registered_compressed_location_map() noexcept {
+        return registered_compressed_location_map;
+    }
+
+} // anonymous namespace
+
+constexpr const std::uint64_t CompressedLocationMap::no_block;
+
+void CompressedLocationMap::encode_current_block() {
+    if (m_current_block == no_block) {
+        return;
+    }
+
+    if (m_current_block >= m_directory.size()) {
+        m_directory.resize(m_current_block + 1, 0);
+    }
+    m_directory[m_current_block] = m_data.size() + 1;
+
+    const auto bitmap_offset = m_data.size();
+    m_data.resize(bitmap_offset + bitmap_bytes);
+    std::memcpy(&m_data[bitmap_offset], m_current_bitmap.data(), bitmap_bytes);
+
+    std::int64_t x = 0;
+    std::int64_t y = 0;
+    for (std::size_t pos = 0; pos < block_size; ++pos) {
+        if (bit_set(m_current_bitmap.data(), pos)) {
+            const auto& location = m_current_locations[pos];
+            write_varint(m_data, zigzag(location.x() - x));
+            write_varint(m_data, zigzag(location.y() - y));
+            x = location.x();
+            y = location.y();
+        }
+    }
+
+    m_current_block = no_block;
+    m_current_bitmap.fill(0);
+}
+
+void CompressedLocationMap::decode_block(std::uint64_t block) {
+    m_current_block = block;
+    if (block >= m_directory.size() || m_directory[block] == 0) {
+        return;
+    }
+
+    const unsigned char* data = &m_data[m_directory[block] - 1];
+    std::memcpy(m_current_bitmap.data(), data, bitmap_bytes);
+    data += bitmap_bytes;
+
+    std::int64_t x = 0;
+    std::int64_t y = 0;
+    for (std::size_t pos = 0; pos < block_size; ++pos) {
+        if (bit_set(m_current_bitmap.data(), pos)) {
+            x += unzigzag(read_varint(data));
+            y += unzigzag(read_varint(data));
+            m_current_locations[pos] = osmium::Location{static_cast<int32_t>(x), static_cast<int32_t>(y)};
+        }
+    }
+}
+
+osmium::Location CompressedLocationMap::lookup(std::uint64_t block, std::size_t pos) const noexcept {
+    if (block == m_current_block) {
+        if (bit_set(m_current_bitmap.data(), pos)) {
+            return m_current_locations[pos];
+        }
+        return osmium::Location{};
+    }
+
+    if (block >= m_directory.size() || m_directory[block] == 0) {
+        return osmium::Location{};
+    }
+
+    const unsigned char* data = &m_data[m_directory[block] - 1];
+    bitmap_type bitmap;
+    std::memcpy(bitmap.data(), data, bitmap_bytes);
+    data += bitmap_bytes;
+
+    if (!bit_set(bitmap.data(), pos)) {
+        return osmium::Location{};
+    }
+
+    std::int64_t x = 0;
+    std::int64_t y = 0;
+    for (std::size_t n = bits_before(bitmap.data(), pos); n > 0; --n) {
+        x += unzigzag(read_varint(data));
+        y += unzigzag(read_varint(data));
+    }
+    x += unzigzag(read_varint(data));
+    y += unzigzag(read_varint(data));
+
+    return osmium::Location{static_cast<int32_t>(x), static_cast<int32_t>(y)};
+}
+
+void CompressedLocationMap::set(const osmium::unsigned_object_id_type id, const osmium::Location value) {
+    const std::uint64_t block = id >> block_bits;
+    const std::size_t pos = id & (block_size - 1);
+
+    if (block != m_current_block) {
+        encode_current_block();
+        decode_block(block);
+    }
+
+    auto& word = m_current_bitmap[pos / 64];
+    const std::uint64_t bit = 1ULL << (pos % 64);
+    if (!(word & bit)) {
+        word |= bit;
+        ++m_size;
+    }
+    m_current_locations[pos] = value;
+}
+
+osmium::Location CompressedLocationMap::get_noexcept(const osmium::unsigned_object_id_type id) const noexcept {
+    return lookup(id >> block_bits, id & (block_size - 1));
+}
+
+osmium::Location CompressedLocationMap::get(const osmium::unsigned_object_id_type id) const {
+    const auto location = get_noexcept(id);
+    if (location == osmium::Location{}) {
+        osmium::index::not_found_error(id);
+    }
+    return location;
+}
+
+std::size_t CompressedLocationMap::used_memory() const {
+    return m_data.capacity() +
+           m_directory.capacity() * sizeof(std::uint64_t) +
+           sizeof(CompressedLocationMap);
+}
+
+void CompressedLocationMap::clear() {
+    m_data.clear();
+    m_data.shrink_to_fit();
+    m_directory.clear();
+    m_directory.shrink_to_fit();
+    m_current_block = no_block;
+    m_current_bitmap.fill(0);
+    m_size = 0;
+}
@@ -0,0 +1,122 @@
+#ifndef COMPRESSED_LOCATION_MAP_HPP
+#define COMPRESSED_LOCATION_MAP_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/index/map.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+/**
+ * Node location index storing the locations in compressed form in memory.
+ *
+ * The ID space is divided into blocks of block_size consecutive IDs. For
+ * each block a bitmap of the IDs present is stored followed by the
+ * coordinates of those IDs, each encoded as zigzag varint of the
+ * difference to the coordinates of the previous ID in the block. Because
+ * nodes with nearby IDs are usually close together, most differences fit
+ * into one or two bytes. A directory with the offset of each block makes
+ * finding a block O(1), inside the block the locations have to be decoded
+ * up to the one asked for.
+ *
+ * Locations are collected uncompressed for the current block and encoded
+ * when the first ID of another block is set. This works best with IDs
+ * added in order, which is the case for sorted OSM files. If an ID from a
+ * block that was already encoded is set, the block is decoded and later
+ * encoded again at the end of the data, the space used by the old version
+ * of the block is lost.
+ *
+ * Calling get() or get_noexcept() from several threads at the same time is
+ * fine, but not while set() is called.
+ *
+ * This index type is registered as "compressed_mem" with the
+ * osmium::index::MapFactory.
+ */
+class CompressedLocationMap : public osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location> {
+
+public:
+
+    enum : std::size_t {
+        block_bits = 7,
+        block_size = 1U << block_bits
+    };
+
+private:
+
+    enum : std::size_t {
+        bitmap_words = block_size / 64,
+        bitmap_bytes = bitmap_words * sizeof(std::uint64_t)
+    };
+
+    using bitmap_type = std::array<std::uint64_t, bitmap_words>;
+
+    static constexpr const std::uint64_t no_block = static_cast<std::uint64_t>(-1);
+
+    // Encoded blocks.
+    std::vector<unsigned char> m_data;
+
+    // Offset into m_data plus one for each block, 0 if there is no data
+    // for a block.
+    std::vector<std::uint64_t> m_directory;
+
+    // The block currently being filled in uncompressed form.
+    std::uint64_t m_current_block = no_block;
+    bitmap_type m_current_bitmap{};
+    std::array<osmium::Location, block_size> m_current_locations;
+
+    std::size_t m_size = 0;
+
+    void encode_current_block();
+
+    void decode_block(std::uint64_t block);
+
+    osmium::Location lookup(std::uint64_t block, std::size_t pos) const noexcept;
+
+public:
+
+    CompressedLocationMap() = default;
+
+    ~CompressedLocationMap() noexcept override = default;
+
+    void set(const osmium::unsigned_object_id_type id, const osmium::Location value) override;
+
+    osmium::Location get(const osmium::unsigned_object_id_type id) const override;
+
+    osmium::Location get_noexcept(const osmium::unsigned_object_id_type id) const noexcept override;
+
+    std::size_t size() const override {
+        return m_size;
+    }
+
+    std::size_t used_memory() const override;
+
+    void clear() override;
+
+}; // class CompressedLocationMap
+
+#endif // COMPRESSED_LOCATION_MAP_HPP
@@ -0,0 +1,243 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+
+#include "external_sort.hpp"
+#include "loser_tree.hpp"
+#include "sort_keys.hpp"
+#include "spill_file.hpp"
+
+static std::size_t run_buffer_size(std::size_t max_memory) noexcept {
+    return std::min(std::max(max_memory / ExternalSorter::merge_fan_in,
+                             static_cast<std::size_t>(ExternalSorter::min_run_buffer_size)),
+                    static_cast<std::size_t>(ExternalSorter::max_run_buffer_size));
+}
+
+ExternalSorter::ExternalSorter(std::size_t max_memory, unsigned int num_threads, sort_order order) :
+    m_max_memory(max_memory),
+    m_buffer_size(run_buffer_size(max_memory)),
+    m_num_threads(num_threads),
+    m_less(order),
+    m_sorted_buffer(m_buffer_size, osmium::memory::Buffer::auto_grow::yes),
+    m_sorted_buffer_written(m_buffer_size, osmium::memory::Buffer::auto_grow::yes),
+    m_objects(order) {
+}
+
+void ExternalSorter::add(const osmium::memory::Buffer& buffer) {
+    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+        if (m_last_sorted && m_less(object, *m_last_sorted)) {
+            end_sorted_run();
+        }
+
+        m_last_sorted = &m_sorted_buffer.add_item(object);
+        m_sorted_buffer.commit();
+
+        if (m_sorted_buffer.committed() >= m_buffer_size) {
+            write_sorted_buffer();
+        }
+    }
+}
+
+void ExternalSorter::write_sorted_buffer() {
+    if (!m_sorted_run) {
+        m_sorted_run.reset(new SpillFile{});
+    }
+    m_sorted_run->write(m_sorted_buffer);
+
+    using std::swap;
+    swap(m_sorted_buffer, m_sorted_buffer_written);
+    m_sorted_buffer.clear();
+}
+
+void ExternalSorter::end_sorted_run() {
+    if (m_sorted_run) {
+        // The objects filled at least one buffer, so they are worth
+        // keeping as a run of their own.
+        m_sorted_run->write(m_sorted_buffer);
+        ++m_num_presorted_runs;
+        add_run(std::move(m_sorted_run));
+    } else {
+        for (const auto& object : m_sorted_buffer.select<osmium::OSMObject>()) {
+            add_unsorted(object);
+        }
+    }
+
+    m_sorted_buffer.clear();
+    m_last_sorted = nullptr;
+}
+
+// Only the data actually in the buffers is counted, not their capacity.
+// Otherwise a fresh buffer alone could use up the budget and every object
+// would end up in a run of its own.
+void ExternalSorter::add_unsorted(const osmium::OSMObject& object) {
+    if (!m_unsorted_buffer || m_unsorted_buffer.capacity() - m_unsorted_buffer.committed() < object.padded_size()) {
+        if (m_unsorted_buffer) {
+            m_memory_used += m_unsorted_buffer.committed();
+            m_buffers.push_back(std::move(m_unsorted_buffer));
+        }
+        m_unsorted_buffer = osmium::memory::Buffer{std::max(m_buffer_size, object.padded_size()), osmium::memory::Buffer::auto_grow::no};
+    }
+
+    m_objects.osm_object(m_unsorted_buffer.add_item(object));
+    m_unsorted_buffer.commit();
+
+    if (m_memory_used + m_unsorted_buffer.committed() + m_objects.size() * sizeof(sort_key) >= m_max_memory) {
+        write_run();
+    }
+}
+
+void ExternalSorter::write_run() {
+    std::unique_ptr<SpillFile> run;
+    if (!m_objects.empty()) {
+        const auto start = std::chrono::steady_clock::now();
+        m_objects.sort(m_num_threads);
+        m_sort_duration += std::chrono::steady_clock::now() - start;
+
+        run.reset(new SpillFile{});
+        osmium::memory::Buffer out{m_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+        for (const auto& key : m_objects) {
+            out.add_item(*key.object);
+            out.commit();
+            if (out.committed() >= m_buffer_size) {
+                run->write(out);
+                out.clear();
+            }
+        }
+        run->write(out);
+    }
+
+    m_objects.clear();
+    m_buffers.clear();
+    m_unsorted_buffer = osmium::memory::Buffer{};
+    m_memory_used = 0;
+
+    // only after the memory is freed, because this might merge runs
+    if (run) {
+        add_run(std::move(run));
+    }
+}
+
+void ExternalSorter::add_run(std::unique_ptr<SpillFile>&& run) {
+    m_runs.push_back(std::move(run));
+    m_run_levels.push_back(0);
+    ++m_num_runs;
+
+    while (m_runs.size() >= merge_fan_in &&
+           m_run_levels[m_runs.size() - merge_fan_in] == m_run_levels.back()) {
+        merge_last_runs(merge_fan_in);
+    }
+}
+
+// Merges the last num_runs runs into one run. Because the merged runs
+// are the last ones, objects that compare equal stay in the order they
+// were added in.
+void ExternalSorter::merge_last_runs(std::size_t num_runs) {
+    const std::size_t first = m_runs.size() - num_runs;
+    const unsigned int level = m_run_levels[first] + 1;
+
+    std::unique_ptr<SpillFile> merged{new SpillFile{}};
+    {
+        std::vector<SortedRun> runs;
+        runs.reserve(num_runs);
+        for (std::size_t i = first; i < m_runs.size(); ++i) {
+            runs.emplace_back(*m_runs[i]);
+        }
+        LoserTree<SortedRun, object_order_less> tree{runs, m_less};
+
+        osmium::memory::Buffer out{m_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+        for (; !tree.empty(); tree.next()) {
+            out.add_item(tree.get());
+            out.commit();
+            if (out.committed() >= m_buffer_size) {
+                merged->write(out);
+                out.clear();
+            }
+        }
+        merged->write(out);
+    }
+
+    m_runs.erase(m_runs.begin() + first, m_runs.end());
+    m_run_levels.erase(m_run_levels.begin() + first, m_run_levels.end());
+    m_runs.push_back(std::move(merged));
+    m_run_levels.push_back(level);
+}
+
+void ExternalSorter::done() {
+    end_sorted_run();
+    write_run();
+
+    // Merge just enough runs that merge_fan_in runs are left.
+    while (m_runs.size() > merge_fan_in) {
+        merge_last_runs(std::min(static_cast<std::size_t>(merge_fan_in), m_runs.size() - merge_fan_in + 1));
+    }
+}
+
+SortedRun::SortedRun(SpillFile& file) :
+    m_file(&file) {
+    m_file->rewind();
+    read_buffer();
+}
+
+void SortedRun::read_buffer() {
+    while (true) {
+        m_buffer = m_file->read();
+        if (!m_buffer) {
+            m_empty = true;
+            return;
+        }
+        m_it = m_buffer.begin<osmium::OSMObject>();
+        m_end = m_buffer.end<osmium::OSMObject>();
+        if (m_it != m_end) {
+            return;
+        }
+    }
+}
+
+void SortedRun::next() {
+    ++m_it;
+    if (m_it == m_end) {
+        read_buffer();
+    }
+}
+
+std::vector<SortedRun> RunMerger::open_runs(const std::vector<std::unique_ptr<SpillFile>>& files) {
+    std::vector<SortedRun> runs;
+    runs.reserve(files.size());
+    for (const auto& file : files) {
+        runs.emplace_back(*file);
+    }
+    return runs;
+}
+
+RunMerger::RunMerger(const std::vector<std::unique_ptr<SpillFile>>& files, sort_order order) :
+    m_runs(open_runs(files)),
+    m_tree(m_runs, object_order_less{order}) {
+}
@@ -0,0 +1,223 @@
+#ifndef EXTERNAL_SORT_HPP
+#define EXTERNAL_SORT_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+
+#include "loser_tree.hpp"
+#include "sort_keys.hpp"
+#include "spill_file.hpp"
+
+/**
+ * Sorts OSM objects using a bounded amount of main memory.
+ *
+ * Buffers are added one after the other. Stretches of objects that are
+ * already in order are written out directly to a temporary file as a
+ * sorted "run" without being sorted. When such a stretch ends before it
+ * filled at least one buffer, its objects are treated like all other
+ * objects that arrived out of order: They are kept in memory and whenever
+ * they use more than the configured maximum, they are sorted and written
+ * out as another run. After all data was added, call done() and use a
+ * RunMerger to read the objects from all runs in order.
+ *
+ * Each run is a temporary file. To limit the number of open files and the
+ * memory needed for reading the runs, whenever there are merge_fan_in runs
+ * of the same size class, they are merged into one run of the next size
+ * class. In done() the last runs are merged until there are at most
+ * merge_fan_in runs left. The runs are written in buffers of a size
+ * chosen so that the buffers of merge_fan_in runs fit into the configured
+ * maximum memory.
+ *
+ * Each run is sorted using up to num_threads threads in the given order.
+ */
+class ExternalSorter {
+
+public:
+
+    enum : std::size_t {
+        // The number of runs merged into one at a time.
+        merge_fan_in = 16,
+
+        // The smallest and largest size of buffers in the runs.
+        min_run_buffer_size = 64 * 1024,
+        max_run_buffer_size = 1024 * 1024
+    };
+
+private:
+
+    std::size_t m_max_memory;
+    std::size_t m_buffer_size;
+    std::size_t m_memory_used = 0;
+    unsigned int m_num_threads;
+    object_order_less m_less;
+    std::chrono::steady_clock::duration m_sort_duration{0};
+
+    // The current stretch of objects that arrived in order. The previously
+    // written buffer is kept around, because m_last_sorted might point
+    // into it.
+    std::unique_ptr<SpillFile> m_sorted_run;
+    osmium::memory::Buffer m_sorted_buffer;
+    osmium::memory::Buffer m_sorted_buffer_written;
+    const osmium::OSMObject* m_last_sorted = nullptr;
+    std::size_t m_num_presorted_runs = 0;
+
+    // Objects that need sorting.
+    osmium::memory::Buffer m_unsorted_buffer;
+    std::vector<osmium::memory::Buffer> m_buffers;
+    SortKeyCollection m_objects;
+
+    // The runs written so far and their size classes. The size classes
+    // never increase from one run to the next, so the runs merged are
+    // always the last ones and the runs stay in the order they were
+    // written.
+    std::vector<std::unique_ptr<SpillFile>> m_runs;
+    std::vector<unsigned int> m_run_levels;
+    std::size_t m_num_runs = 0;
+
+    void add_run(std::unique_ptr<SpillFile>&& run);
+
+    void merge_last_runs(std::size_t num_runs);
+
+    void write_sorted_buffer();
+
+    void end_sorted_run();
+
+    void add_unsorted(const osmium::OSMObject& object);
+
+    void write_run();
+
+public:
+
+    ExternalSorter(std::size_t max_memory, unsigned int num_threads, sort_order order = sort_order::type_id_version);
+
+    void add(const osmium::memory::Buffer& buffer);
+
+    // Write out all objects still in memory.
+    void done();
+
+    // The number of runs written before merging any of them.
+    std::size_t num_runs() const noexcept {
+        return m_num_runs;
+    }
+
+    // The size of the buffers in the runs.
+    std::size_t buffer_size() const noexcept {
+        return m_buffer_size;
+    }
+
+    // The number of runs that were already sorted in the input.
+    std::size_t num_presorted_runs() const noexcept {
+        return m_num_presorted_runs;
+    }
+
+    // Wall-clock time spent sorting the runs.
+    std::chrono::steady_clock::duration sort_duration() const noexcept {
+        return m_sort_duration;
+    }
+
+    std::vector<std::unique_ptr<SpillFile>>& runs() noexcept {
+        return m_runs;
+    }
+
+}; // class ExternalSorter
+
+/**
+ * One sorted run in a temporary file. Only one buffer of the run is in
+ * memory at any time.
+ */
+class SortedRun {
+
+    using iterator = osmium::memory::Buffer::t_iterator<osmium::OSMObject>;
+
+    SpillFile* m_file;
+    osmium::memory::Buffer m_buffer;
+    iterator m_it;
+    iterator m_end;
+    bool m_empty = false;
+
+    void read_buffer();
+
+public:
+
+    explicit SortedRun(SpillFile& file);
+
+    bool empty() const noexcept {
+        return m_empty;
+    }
+
+    const osmium::OSMObject& get() const noexcept {
+        return *m_it;
+    }
+
+    // Go to next object. This invalidates the reference returned by the
+    // last call to get().
+    void next();
+
+}; // class SortedRun
+
+/**
+ * Merges several sorted runs into one sorted stream of objects. The order
+ * must be the same as the one used for sorting the runs.
+ */
+class RunMerger {
+
+    std::vector<SortedRun> m_runs;
+    LoserTree<SortedRun, object_order_less> m_tree;
+
+    static std::vector<SortedRun> open_runs(const std::vector<std::unique_ptr<SpillFile>>& files);
+
+public:
+
+    explicit RunMerger(const std::vector<std::unique_ptr<SpillFile>>& files, sort_order order = sort_order::type_id_version);
+
+    // The tree refers to m_runs, so this can't be copied or moved.
+    RunMerger(const RunMerger&) = delete;
+    RunMerger& operator=(const RunMerger&) = delete;
+
+    RunMerger(RunMerger&&) = delete;
+    RunMerger& operator=(RunMerger&&) = delete;
+
+    bool empty() const noexcept {
+        return m_tree.empty();
+    }
+
+    const osmium::OSMObject& get() const noexcept {
+        return m_tree.get();
+    }
+
+    // Go to next object. This invalidates the reference returned by the
+    // last call to get().
+    void next() {
+        m_tree.next();
+    }
+
+}; // class RunMerger
+
+#endif // EXTERNAL_SORT_HPP
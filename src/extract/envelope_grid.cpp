@@ -0,0 +1,122 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+
+#include "envelope_grid.hpp"
+
+EnvelopeGrid::EnvelopeGrid(const std::vector<osmium::Box>& boxes) {
+    osmium::Box bounds;
+    for (const auto& box : boxes) {
+        if (box.valid()) {
+            bounds.extend(box);
+        }
+    }
+
+    if (!bounds.valid()) {
+        return;
+    }
+
+    const auto side = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(boxes.size() * cells_per_box))));
+    m_columns = std::min(side, static_cast<std::size_t>(max_cells_per_dimension));
+    m_rows = m_columns;
+
+    m_min_x = bounds.bottom_left().x();
+    m_min_y = bounds.bottom_left().y();
+    const int64_t width  = static_cast<int64_t>(bounds.top_right().x()) - m_min_x + 1;
+    const int64_t height = static_cast<int64_t>(bounds.top_right().y()) - m_min_y + 1;
+    m_cell_width  = (width  + static_cast<int64_t>(m_columns) - 1) / static_cast<int64_t>(m_columns);
+    m_cell_height = (height + static_cast<int64_t>(m_rows)    - 1) / static_cast<int64_t>(m_rows);
+
+    // Count the boxes in each cell first, then fill in the indexes.
+    std::vector<std::size_t> counts(m_columns * m_rows, 0);
+    const auto for_each_cell = [this](const osmium::Box& box, const std::function<void(std::size_t)>& func) {
+        const auto col_min = column(box.bottom_left().x());
+        const auto col_max = column(box.top_right().x());
+        const auto row_min = row(box.bottom_left().y());
+        const auto row_max = row(box.top_right().y());
+        for (auto r = row_min; r <= row_max; ++r) {
+            for (auto c = col_min; c <= col_max; ++c) {
+                func(r * m_columns + c);
+            }
+        }
+    };
+
+    for (const auto& box : boxes) {
+        if (box.valid()) {
+            for_each_cell(box, [&counts](std::size_t cell) {
+                ++counts[cell];
+            });
+        }
+    }
+
+    m_offsets.reserve(counts.size() + 1);
+    std::size_t offset = 0;
+    for (const auto count : counts) {
+        m_offsets.push_back(offset);
+        offset += count;
+    }
+    m_offsets.push_back(offset);
+
+    m_indexes.resize(offset);
+    std::vector<std::size_t> next{m_offsets.begin(), std::prev(m_offsets.end())};
+    for (std::size_t i = 0; i < boxes.size(); ++i) {
+        if (boxes[i].valid()) {
+            for_each_cell(boxes[i], [this, &next, i](std::size_t cell) {
+                m_indexes[next[cell]++] = static_cast<index_type>(i);
+            });
+        }
+    }
+}
+
+std::size_t EnvelopeGrid::column(int32_t x) const noexcept {
+    return static_cast<std::size_t>((static_cast<int64_t>(x) - m_min_x) / m_cell_width);
+}
+
+std::size_t EnvelopeGrid::row(int32_t y) const noexcept {
+    return static_cast<std::size_t>((static_cast<int64_t>(y) - m_min_y) / m_cell_height);
+}
+
+std::pair<EnvelopeGrid::const_iterator, EnvelopeGrid::const_iterator> EnvelopeGrid::candidates(const osmium::Location& location) const noexcept {
+    if (m_offsets.empty() || !location.valid() || location.x() < m_min_x || location.y() < m_min_y) {
+        return std::make_pair(m_indexes.cend(), m_indexes.cend());
+    }
+
+    const auto c = column(location.x());
+    const auto r = row(location.y());
+    if (c >= m_columns || r >= m_rows) {
+        return std::make_pair(m_indexes.cend(), m_indexes.cend());
+    }
+
+    const auto cell = r * m_columns + c;
+    return std::make_pair(m_indexes.cbegin() + m_offsets[cell], m_indexes.cbegin() + m_offsets[cell + 1]);
+}
@@ -0,0 +1,83 @@
+#ifndef EXTRACT_ENVELOPE_GRID_HPP
+#define EXTRACT_ENVELOPE_GRID_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+
+/**
+ * A regular grid over a number of boxes (the envelopes of the extracts)
+ * used to quickly find the boxes that might contain a location. Each
+ * grid cell has a list of the indexes of all boxes overlapping the cell.
+ * The grid covers the area of all boxes and has about cells_per_box
+ * cells for each box up to a maximum size.
+ */
+class EnvelopeGrid {
+
+    using index_type = uint32_t;
+
+    int32_t m_min_x = 0;
+    int32_t m_min_y = 0;
+    int64_t m_cell_width = 1;
+    int64_t m_cell_height = 1;
+    std::size_t m_columns = 0;
+    std::size_t m_rows = 0;
+
+    // The box indexes for cell n are in m_indexes between m_offsets[n]
+    // and m_offsets[n + 1], sorted by index.
+    std::vector<std::size_t> m_offsets;
+    std::vector<index_type> m_indexes;
+
+    std::size_t column(int32_t x) const noexcept;
+
+    std::size_t row(int32_t y) const noexcept;
+
+public:
+
+    using const_iterator = std::vector<index_type>::const_iterator;
+
+    enum : std::size_t {
+        cells_per_box = 16,
+        max_cells_per_dimension = 1024
+    };
+
+    EnvelopeGrid() = default;
+
+    explicit EnvelopeGrid(const std::vector<osmium::Box>& boxes);
+
+    /**
+     * The indexes of all boxes that might contain the location. This is
+     * a superset of the boxes that really contain the location. The
+     * indexes are in increasing order.
+     */
+    std::pair<const_iterator, const_iterator> candidates(const osmium::Location& location) const noexcept;
+
+}; // class EnvelopeGrid
+
+#endif // EXTRACT_ENVELOPE_GRID_HPP
@@ -22,10 +22,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <sstream>
 #include <string>
+#include <utility>
 
 #include <osmium/io/writer_options.hpp>
+#include <osmium/memory/item.hpp>
+#include <osmium/osm/location.hpp>
 
 #include "extract.hpp"
+#include "writer_threads.hpp"
 
 namespace osmium {
     namespace io {
@@ -36,18 +40,43 @@ namespace osmium {
     }
 }
 
-void Extract::open_file(const osmium::io::Header& header, osmium::io::overwrite output_overwrite, osmium::io::fsync sync) {
+void Extract::open_file(const osmium::io::Header& header, osmium::io::overwrite output_overwrite, osmium::io::fsync sync, WriterThreads* writer_threads) {
     m_writer.reset(new osmium::io::Writer{m_output_file, header, output_overwrite, sync});
+    if (writer_threads) {
+        m_writer_threads = writer_threads;
+        m_writer_queue = writer_threads->assign();
+        m_buffer = osmium::memory::Buffer{write_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+    }
+}
+
+void Extract::flush_buffer() {
+    if (m_buffer.committed() > 0) {
+        m_writer_threads->add(m_writer_queue, *m_writer, std::move(m_buffer));
+        m_buffer = osmium::memory::Buffer{write_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+    }
 }
 
 void Extract::close_file() {
-    if (m_writer) {
+    if (!m_writer) {
+        return;
+    }
+    if (m_writer_threads) {
+        flush_buffer();
+        m_writer_threads->close(m_writer_queue, *m_writer);
+    } else {
         m_writer->close();
     }
 }
 
 void Extract::write(const osmium::memory::Item& item) {
-    (*m_writer)(item);
+    if (!m_writer_threads) {
+        (*m_writer)(item);
+        return;
+    }
+    if (m_buffer.committed() + item.padded_size() > m_buffer.capacity()) {
+        flush_buffer();
+    }
+    m_buffer.push_back(item);
 }
 
 std::string Extract::envelope_as_text() const {
@@ -56,3 +85,8 @@ std::string Extract::envelope_as_text() const {
     return ss.str();
 }
 
+void Extract::classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept {
+    for (; first != last; ++first, ++inside) {
+        *inside = contains(*first);
+    }
+}
@@ -23,16 +23,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <osmium/memory/buffer.hpp>
 #include <osmium/osm/box.hpp>
 #include <osmium/io/file.hpp>
 #include <osmium/io/writer_options.hpp>
 #include <osmium/io/writer.hpp>
 
+class WriterThreads;
+
 namespace osmium {
     class Box;
     class Location;
@@ -53,6 +57,15 @@ class Extract {
     std::vector<std::pair<std::string, std::string>> m_header_options;
     osmium::Box m_envelope;
     std::unique_ptr<osmium::io::Writer> m_writer;
+    const Extract* m_parent = nullptr;
+
+    // If m_writer_threads is set, objects are collected in m_buffer which
+    // is handed over to the writer threads when it is full.
+    WriterThreads* m_writer_threads = nullptr;
+    std::size_t m_writer_queue = 0;
+    osmium::memory::Buffer m_buffer;
+
+    void flush_buffer();
 
 public:
 
@@ -60,7 +73,8 @@ public:
         m_output_file(output_file),
         m_description(description),
         m_envelope(envelope),
-        m_writer(nullptr) {
+        m_writer(nullptr),
+        m_buffer() {
     }
 
     virtual ~Extract() = default;
@@ -81,6 +95,18 @@ public:
         return m_envelope;
     }
 
+    /**
+     * The parent extract or nullptr if there is none. Only nodes inside
+     * the parent extract can be inside this extract.
+     */
+    const Extract* parent() const noexcept {
+        return m_parent;
+    }
+
+    void set_parent(const Extract* parent) noexcept {
+        m_parent = parent;
+    }
+
     void add_header_option(const std::string& name, const std::string& value) {
         m_header_options.emplace_back(name, value);
     }
@@ -93,7 +119,15 @@ public:
         return *m_writer;
     }
 
-    void open_file(const osmium::io::Header& header, osmium::io::overwrite output_overwrite, osmium::io::fsync sync);
+    enum : std::size_t {
+        write_buffer_size = 1024 * 1024
+    };
+
+    /**
+     * Open the output file. If writer_threads is not nullptr, the output
+     * is written asynchronously by those threads.
+     */
+    void open_file(const osmium::io::Header& header, osmium::io::overwrite output_overwrite, osmium::io::fsync sync, WriterThreads* writer_threads = nullptr);
 
     void close_file();
 
@@ -103,6 +137,15 @@ public:
 
     virtual bool contains(const osmium::Location& location) const noexcept = 0;
 
+    /**
+     * Check for each location in the range [first, last) whether it is
+     * inside this extract and set the corresponding entry in the array
+     * inside to 1 if it is or to 0 if it isn't. Does the same as calling
+     * contains() for each location, but subclasses can override it with
+     * a loop the compiler can optimize better.
+     */
+    virtual void classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept;
+
     virtual const char* geometry_type() const noexcept = 0;
 
     virtual std::string geometry_as_text() const = 0;
@@ -20,6 +20,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 
 #include <osmium/osm/location.hpp>
@@ -30,6 +32,22 @@ bool ExtractBBox::contains(const osmium::Location& location) const noexcept {
     return location.valid() && envelope().contains(location);
 }
 
+void ExtractBBox::classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept {
+    // The box is clipped to the range of valid locations, so there is
+    // no need for a separate valid() check and there are no branches in
+    // the loop which can be vectorized by the compiler.
+    const osmium::Location valid_min{-180.0, -90.0};
+    const osmium::Location valid_max{180.0, 90.0};
+    const int32_t min_x = std::max(envelope().bottom_left().x(), valid_min.x());
+    const int32_t min_y = std::max(envelope().bottom_left().y(), valid_min.y());
+    const int32_t max_x = std::min(envelope().top_right().x(), valid_max.x());
+    const int32_t max_y = std::min(envelope().top_right().y(), valid_max.y());
+    for (; first != last; ++first, ++inside) {
+        *inside = (first->x() >= min_x) & (first->x() <= max_x) &
+                  (first->y() >= min_y) & (first->y() <= max_y);
+    }
+}
+
 const char* ExtractBBox::geometry_type() const noexcept {
     return "bbox";
 }
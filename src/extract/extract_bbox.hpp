@@ -35,6 +35,8 @@ public:
 
     bool contains(const osmium::Location& location) const noexcept override final;
 
+    void classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept override final;
+
     const char* geometry_type() const noexcept override final;
 
     std::string geometry_as_text() const override final;
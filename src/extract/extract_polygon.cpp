@@ -22,6 +22,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <string>
@@ -50,69 +51,100 @@ const osmium::Area& ExtractPolygon::area() const noexcept {
     return m_buffer.get<osmium::Area>(m_offset);
 }
 
-ExtractPolygon::ExtractPolygon(const osmium::io::File& output_file, const std::string& description, const osmium::memory::Buffer& buffer, std::size_t offset) :
-    Extract(output_file, description, buffer.get<osmium::Area>(offset).envelope()),
-    m_buffer(buffer),
-    m_offset(offset),
-    m_bands(),
-    m_dy(0) {
-
-    // get segments from all rings
+// get segments from all rings
+static std::vector<osmium::Segment> get_segments(const osmium::Area& area) {
     std::vector<osmium::Segment> segments;
-    for (const auto& outer_ring : area().outer_rings()) {
+    for (const auto& outer_ring : area.outer_rings()) {
         add_ring(segments, outer_ring);
 
-        for (const auto& inner_ring : area().inner_rings(outer_ring)) {
+        for (const auto& inner_ring : area.inner_rings(outer_ring)) {
             add_ring(segments, inner_ring);
         }
     }
+    return segments;
+}
 
-    // split y range into equal-sized bands
-    constexpr const int32_t segments_per_band = 10;
-    constexpr const int32_t max_bands = 10000;
-    int32_t num_bands = static_cast<int32_t>(segments.size()) / segments_per_band;
-    if (num_bands < 1) {
-        num_bands = 1;
-    } else if (num_bands > max_bands) {
-        num_bands = max_bands;
-    }
+ExtractPolygon::ExtractPolygon(const osmium::io::File& output_file, const std::string& description, const osmium::memory::Buffer& buffer, std::size_t offset, const std::vector<osmium::Segment>& segments) :
+    Extract(output_file, description, buffer.get<osmium::Area>(offset).envelope()),
+    m_buffer(buffer),
+    m_offset(offset),
+    m_bands(segments, envelope(), best_pip_kernel(envelope())) {
+    build_cells(segments);
+}
 
-    m_bands.resize(num_bands);
+ExtractPolygon::ExtractPolygon(const osmium::io::File& output_file, const std::string& description, const osmium::memory::Buffer& buffer, std::size_t offset) :
+    ExtractPolygon(output_file, description, buffer, offset, get_segments(buffer.get<osmium::Area>(offset))) {
+}
 
-    m_dy = (y_max() - y_min()) / num_bands;
+std::size_t ExtractPolygon::cell_index(const osmium::Location& location) const noexcept {
+    const auto col = (int64_t(location.x()) - envelope().bottom_left().x()) / m_cell_width;
+    const auto row = (int64_t(location.y()) - y_min()) / m_cell_height;
+    return static_cast<std::size_t>(row * m_cells_per_row + col);
+}
 
-    // put segments into the bands they overlap
+void ExtractPolygon::build_cells(const std::vector<osmium::Segment>& segments) {
+    // about four cells per segment
+    constexpr const int32_t max_cells_per_row = 1024;
+    m_cells_per_row = std::min(max_cells_per_row, std::max(1, static_cast<int32_t>(std::sqrt(segments.size() * 4.0))));
+
+    const int64_t width  = int64_t(envelope().top_right().x()) - envelope().bottom_left().x() + 1;
+    const int64_t height = int64_t(y_max()) - y_min() + 1;
+    m_cell_width  = (width  + m_cells_per_row - 1) / m_cells_per_row;
+    m_cell_height = (height + m_cells_per_row - 1) / m_cells_per_row;
+
+    m_cells.assign(static_cast<std::size_t>(m_cells_per_row) * m_cells_per_row, cell_type::outside);
+
+    // Mark all cells a segment goes through as boundary cells. Longer
+    // segments are split into pieces no longer than a cell, and all cells
+    // overlapping the bounding box (plus one unit to be safe from rounding
+    // errors) of a piece are marked.
     for (const auto& segment : segments) {
-        const std::pair<int32_t, int32_t> mm = std::minmax(segment.first().y(), segment.second().y());
-        const uint32_t band_min = (mm.first  - y_min()) / m_dy;
-        const uint32_t band_max = std::min(num_bands, ((mm.second - y_min()) / m_dy) + 1);
+        const double x1 = segment.first().x();
+        const double y1 = segment.first().y();
+        const double x2 = segment.second().x();
+        const double y2 = segment.second().y();
+        const double pieces = std::ceil(std::max(std::abs(x2 - x1) / m_cell_width, std::abs(y2 - y1) / m_cell_height)) + 1;
+        for (double i = 0; i < pieces; ++i) {
+            const double ax = x1 + (x2 - x1) * i / pieces;
+            const double ay = y1 + (y2 - y1) * i / pieces;
+            const double bx = x1 + (x2 - x1) * (i + 1) / pieces;
+            const double by = y1 + (y2 - y1) * (i + 1) / pieces;
+            const auto minmax_x = std::minmax(ax, bx);
+            const auto minmax_y = std::minmax(ay, by);
+            const int64_t col_min = std::max(int64_t(0), (int64_t(std::floor(minmax_x.first)) - 1 - envelope().bottom_left().x()) / m_cell_width);
+            const int64_t col_max = std::min(int64_t(m_cells_per_row - 1), (int64_t(std::ceil(minmax_x.second)) + 1 - envelope().bottom_left().x()) / m_cell_width);
+            const int64_t row_min = std::max(int64_t(0), (int64_t(std::floor(minmax_y.first)) - 1 - y_min()) / m_cell_height);
+            const int64_t row_max = std::min(int64_t(m_cells_per_row - 1), (int64_t(std::ceil(minmax_y.second)) + 1 - y_min()) / m_cell_height);
+            for (int64_t row = row_min; row <= row_max; ++row) {
+                for (int64_t col = col_min; col <= col_max; ++col) {
+                    m_cells[row * m_cells_per_row + col] = cell_type::boundary;
+                }
+            }
+        }
+    }
 
-        for (auto band = band_min; band < band_max; ++band) {
-            m_bands[band].push_back(segment);
+    // All points in a cell without segments are either inside or outside,
+    // so testing one point in the cell is enough.
+    for (int32_t row = 0; row < m_cells_per_row; ++row) {
+        for (int32_t col = 0; col < m_cells_per_row; ++col) {
+            auto& cell = m_cells[row * m_cells_per_row + col];
+            if (cell == cell_type::boundary) {
+                continue;
+            }
+            const osmium::Location location{
+                static_cast<int32_t>(std::min(int64_t(envelope().top_right().x()), envelope().bottom_left().x() + col * m_cell_width)),
+                static_cast<int32_t>(std::min(int64_t(y_max()), y_min() + row * m_cell_height))
+            };
+            cell = m_bands.contains(location) ? cell_type::inside : cell_type::outside;
         }
     }
 }
 
 /*
 
-  Simple point-in-polygon algorithm adapted from
-
-  https://www.ecse.rpi.edu/Homepages/wrf/Research/Short_Notes/pnpoly.html
-
-    int pnpoly(int nvert, float *vertx, float *verty, float testx, float testy)
-    {
-        int i, j, c = 0;
-        for (i = 0, j = nvert-1; i < nvert; j = i++) {
-            if ( ((verty[i]>testy) != (verty[j]>testy)) &&
-                (testx < (vertx[j]-vertx[i]) * (testy-verty[i]) / (verty[j]-verty[i]) + vertx[i]) )
-            c = !c;
-        }
-        return c;
-    }
-
-  In our implementation we split the y-range into equal-sized subranges and
-  only have to test all segments in the subrange that contains the y coordinate
-  of the node.
+  We first look at the grid cell the node is in. Only if it is a boundary
+  cell we have to do the point-in-polygon test on the segments of the
+  polygon (see PolygonBands).
 
 */
 
@@ -121,33 +153,23 @@ bool ExtractPolygon::contains(const osmium::Location& location) const noexcept {
         return false;
     }
 
-    std::size_t band = (location.y() - y_min()) / m_dy;
-    if (band >= m_bands.size()) {
-        band = m_bands.size() - 1;
-    }
-
-    bool inside = false;
-
-    for (const auto& segment : m_bands[band]) {
-        if (segment.first() == location || segment.second() == location) {
+    switch (m_cells[cell_index(location)]) {
+        case cell_type::inside:
             return true;
-        }
-        if ((segment.second().y() > location.y()) != (segment.first().y() > location.y())) {
-            const int64_t ax = int64_t(segment.first().x()) - int64_t(segment.second().x());
-            const int64_t ay = int64_t(segment.first().y()) - int64_t(segment.second().y());
-            const int64_t tx = int64_t(location.x())        - int64_t(segment.second().x());
-            const int64_t ty = int64_t(location.y())        - int64_t(segment.second().y());
-
-            const bool comp = tx * ay < ax * ty;
+        case cell_type::outside:
+            return false;
+        default:
+            break;
+    }
 
-            if ((ay > 0) == comp) {
-                inside = !inside;
-            }
-        }
+    return m_bands.contains(location);
+}
 
+void ExtractPolygon::classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept {
+    // contains() is final, so this doesn't need a virtual call per location
+    for (; first != last; ++first, ++inside) {
+        *inside = ExtractPolygon::contains(*first);
     }
-
-    return inside;
 }
 
 const char* ExtractPolygon::geometry_type() const noexcept {
@@ -23,9 +23,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 #include "extract.hpp"
+#include "point_in_polygon.hpp"
 
 namespace osmium {
     class Area;
@@ -37,11 +40,28 @@ class ExtractPolygon : public Extract {
     const osmium::memory::Buffer& m_buffer;
     std::size_t m_offset;
 
-    std::vector<std::vector<osmium::Segment>> m_bands;
-    int32_t m_dy;
+    PolygonBands m_bands;
+
+    // A grid over the envelope. Each cell is either completely inside or
+    // completely outside the polygon, or a boundary cell with segments
+    // of the polygon going through it.
+    enum class cell_type : unsigned char {
+        outside  = 0,
+        inside   = 1,
+        boundary = 2
+    };
+
+    std::vector<cell_type> m_cells;
+    int32_t m_cells_per_row = 0;
+    int64_t m_cell_width = 1;
+    int64_t m_cell_height = 1;
 
     const osmium::Area& area() const noexcept;
 
+    void build_cells(const std::vector<osmium::Segment>& segments);
+
+    std::size_t cell_index(const osmium::Location& location) const noexcept;
+
     int32_t y_max() const noexcept {
         return envelope().top_right().y();
     }
@@ -50,12 +70,16 @@ class ExtractPolygon : public Extract {
         return envelope().bottom_left().y();
     }
 
+    ExtractPolygon(const osmium::io::File& output_file, const std::string& description, const osmium::memory::Buffer& buffer, std::size_t offset, const std::vector<osmium::Segment>& segments);
+
 public:
 
     ExtractPolygon(const osmium::io::File& output_file, const std::string& description, const osmium::memory::Buffer& buffer, std::size_t offset);
 
     bool contains(const osmium::Location& location) const noexcept override final;
 
+    void classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept override final;
+
     const char* geometry_type() const noexcept override final;
 
     std::string geometry_as_text() const override final;
@@ -0,0 +1,174 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "id_pair_sorter.hpp"
+
+IdPairSorter::Run::Run(std::vector<id_pair>&& pairs) :
+    m_pairs(std::move(pairs)) {
+}
+
+IdPairSorter::Run::Run(file_ptr&& file, std::size_t block_size) :
+    m_file(std::move(file)),
+    m_block_size(block_size) {
+    read_block();
+}
+
+void IdPairSorter::Run::read_block() {
+    m_pairs.resize(m_block_size);
+    const std::size_t count = std::fread(m_pairs.data(), sizeof(id_pair), m_block_size, m_file.get());
+    if (count < m_block_size && std::ferror(m_file.get())) {
+        throw std::system_error{errno, std::system_category(), "Read from temporary file failed"};
+    }
+    m_pairs.resize(count);
+    m_pos = 0;
+    if (count == 0) {
+        m_file.reset();
+    }
+}
+
+void IdPairSorter::Run::next() {
+    ++m_pos;
+    if (m_pos == m_pairs.size() && m_file) {
+        read_block();
+    }
+}
+
+IdPairSorter::IdPairSorter(std::size_t max_memory) :
+    m_max_pairs(std::max(max_memory / sizeof(id_pair), static_cast<std::size_t>(1))) {
+}
+
+// The blocks read from all runs together should not need more memory
+// than the pairs collected before writing a run.
+std::size_t IdPairSorter::block_size(std::size_t num_runs) const noexcept {
+    return std::min(std::max(m_max_pairs / num_runs, static_cast<std::size_t>(1)),
+                    static_cast<std::size_t>(max_block_size));
+}
+
+// Open the runs in the files from position first on for reading.
+std::vector<IdPairSorter::Run> IdPairSorter::open_runs(std::size_t first) {
+    const std::size_t num_runs = m_files.size() - first;
+    std::vector<Run> runs;
+    runs.reserve(num_runs);
+    for (auto it = m_files.begin() + first; it != m_files.end(); ++it) {
+        if (std::fflush(it->get()) != 0) {
+            throw std::system_error{errno, std::system_category(), "Write to temporary file failed"};
+        }
+        std::rewind(it->get());
+        runs.emplace_back(std::move(*it), block_size(num_runs));
+    }
+    m_files.erase(m_files.begin() + first, m_files.end());
+    m_levels.erase(m_levels.begin() + first, m_levels.end());
+    return runs;
+}
+
+void IdPairSorter::write_pairs(std::FILE* file, const std::vector<id_pair>& pairs) {
+    if (std::fwrite(pairs.data(), sizeof(id_pair), pairs.size(), file) != pairs.size()) {
+        throw std::system_error{errno, std::system_category(), "Write to temporary file failed"};
+    }
+    m_bytes_written += pairs.size() * sizeof(id_pair);
+}
+
+static std::FILE* create_file() {
+    std::FILE* file = std::tmpfile();
+    if (!file) {
+        throw std::system_error{errno, std::system_category(), "Could not create temporary file"};
+    }
+    return file;
+}
+
+void IdPairSorter::sort_pairs() {
+    std::sort(m_pairs.begin(), m_pairs.end());
+    m_pairs.erase(std::unique(m_pairs.begin(), m_pairs.end()), m_pairs.end());
+}
+
+void IdPairSorter::write_run() {
+    sort_pairs();
+
+    file_ptr file{create_file()};
+    write_pairs(file.get(), m_pairs);
+    ++m_num_runs;
+    m_files.push_back(std::move(file));
+    m_levels.push_back(0);
+    m_pairs.clear();
+
+    while (m_levels.size() >= merge_runs &&
+           m_levels[m_levels.size() - merge_runs] == m_levels.back()) {
+        merge_last_runs();
+    }
+}
+
+// Merges the last merge_runs runs, which are all of the same size class,
+// into one of the next size class.
+void IdPairSorter::merge_last_runs() {
+    const unsigned int level = m_levels.back() + 1;
+    std::vector<Run> runs{open_runs(m_files.size() - merge_runs)};
+    LoserTree<Run, std::less<id_pair>> tree{runs};
+
+    file_ptr file{create_file()};
+    const std::size_t size = block_size(1);
+    std::vector<id_pair> pairs;
+    pairs.reserve(size);
+    bool first = true;
+    id_pair last{0, 0};
+
+    for (; !tree.empty(); tree.next()) {
+        const id_pair& pair = tree.get();
+        if (!first && pair == last) {
+            continue;
+        }
+        first = false;
+        last = pair;
+        pairs.push_back(pair);
+        if (pairs.size() == size) {
+            write_pairs(file.get(), pairs);
+            pairs.clear();
+        }
+    }
+    write_pairs(file.get(), pairs);
+
+    m_files.push_back(std::move(file));
+    m_levels.push_back(level);
+}
+
+void IdPairSorter::done() {
+    if (m_files.empty()) {
+        // everything fits into memory
+        sort_pairs();
+        m_runs.emplace_back(std::move(m_pairs));
+    } else {
+        if (!m_pairs.empty()) {
+            write_run();
+        }
+        m_runs = open_runs(0);
+    }
+
+    std::vector<id_pair>{}.swap(m_pairs);
+    m_merger.reset(new LoserTree<Run, std::less<id_pair>>{m_runs});
+}
@@ -0,0 +1,189 @@
+#ifndef EXTRACT_ID_PAIR_SORTER_HPP
+#define EXTRACT_ID_PAIR_SORTER_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "../loser_tree.hpp"
+
+/**
+ * Collects pairs of an ID and an index and gives them back sorted by ID
+ * and index using a bounded amount of main memory. This is used to remember
+ * which nodes are needed by which extract without keeping an ID set for
+ * each extract.
+ *
+ * Whenever the pairs in memory take up more than the configured maximum,
+ * they are sorted and written out to a temporary file as a sorted run.
+ * To limit the number of open files, whenever there are merge_runs runs of
+ * the same size class, they are merged into one run of the next size
+ * class. So each pair is only copied a few times. After all pairs were
+ * added, call done() and read them back in order with empty(), get(), and
+ * next(). Duplicate pairs are not always removed, so the same pair can be
+ * returned more than once.
+ */
+class IdPairSorter {
+
+public:
+
+    struct id_pair {
+        uint64_t id;
+        uint64_t index;
+
+        friend bool operator<(const id_pair& lhs, const id_pair& rhs) noexcept {
+            return lhs.id < rhs.id || (lhs.id == rhs.id && lhs.index < rhs.index);
+        }
+
+        friend bool operator==(const id_pair& lhs, const id_pair& rhs) noexcept {
+            return lhs.id == rhs.id && lhs.index == rhs.index;
+        }
+    };
+
+private:
+
+    enum : std::size_t {
+        // The number of runs of the same size class merged into one.
+        merge_runs = 16,
+
+        // The maximum number of pairs read from a temporary file at a time.
+        max_block_size = 64 * 1024
+    };
+
+    struct file_closer {
+        void operator()(std::FILE* file) const noexcept {
+            std::fclose(file);
+        }
+    };
+
+    using file_ptr = std::unique_ptr<std::FILE, file_closer>;
+
+    /**
+     * One sorted run. It is either kept in memory completely or read
+     * back from a temporary file a block at a time.
+     */
+    class Run {
+
+        file_ptr m_file;
+        std::vector<id_pair> m_pairs;
+        std::size_t m_pos = 0;
+        std::size_t m_block_size = 0;
+
+        void read_block();
+
+    public:
+
+        explicit Run(std::vector<id_pair>&& pairs);
+
+        // Read the run from the file (which must be rewound already)
+        // block_size pairs at a time.
+        Run(file_ptr&& file, std::size_t block_size);
+
+        bool empty() const noexcept {
+            return m_pos == m_pairs.size();
+        }
+
+        const id_pair& get() const noexcept {
+            return m_pairs[m_pos];
+        }
+
+        void next();
+
+    }; // class Run
+
+    std::size_t m_max_pairs;
+    std::vector<id_pair> m_pairs;
+
+    // Files with the runs written so far and their size classes. The
+    // size classes never increase from one file to the next.
+    std::vector<file_ptr> m_files;
+    std::vector<unsigned int> m_levels;
+
+    std::size_t m_num_runs = 0;
+    std::size_t m_bytes_written = 0;
+
+    std::vector<Run> m_runs;
+    std::unique_ptr<LoserTree<Run, std::less<id_pair>>> m_merger;
+
+    std::size_t block_size(std::size_t num_runs) const noexcept;
+
+    std::vector<Run> open_runs(std::size_t first);
+
+    void write_pairs(std::FILE* file, const std::vector<id_pair>& pairs);
+
+    void sort_pairs();
+
+    void write_run();
+
+    void merge_last_runs();
+
+public:
+
+    explicit IdPairSorter(std::size_t max_memory);
+
+    // The merger refers to m_runs, so this can't be copied or moved.
+    IdPairSorter(const IdPairSorter&) = delete;
+    IdPairSorter& operator=(const IdPairSorter&) = delete;
+
+    IdPairSorter(IdPairSorter&&) = delete;
+    IdPairSorter& operator=(IdPairSorter&&) = delete;
+
+    void add(uint64_t id, uint64_t index) {
+        m_pairs.push_back(id_pair{id, index});
+        if (m_pairs.size() >= m_max_pairs) {
+            write_run();
+        }
+    }
+
+    // Call after the last add() and before reading the pairs.
+    void done();
+
+    bool empty() const noexcept {
+        return m_merger->empty();
+    }
+
+    const id_pair& get() const noexcept {
+        return m_merger->get();
+    }
+
+    void next() {
+        m_merger->next();
+    }
+
+    // The number of runs written to temporary files.
+    std::size_t num_runs() const noexcept {
+        return m_num_runs;
+    }
+
+    // The number of bytes written to temporary files.
+    std::size_t bytes_written() const noexcept {
+        return m_bytes_written;
+    }
+
+}; // class IdPairSorter
+
+#endif // EXTRACT_ID_PAIR_SORTER_HPP
@@ -0,0 +1,196 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "id_set.hpp"
+
+constexpr const IdSetAdaptive::id_type IdSetAdaptive::no_id;
+
+static int lowest_bit(uint64_t bits) noexcept {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int n = 0;
+    while ((bits & 1U) == 0) {
+        bits >>= 1U;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+void IdSetAdaptive::Chunk::make_bitmap() {
+    m_bitmap.reset(new uint64_t[bitmap_words]());
+    for (const auto low : m_array) {
+        m_bitmap[low >> 6U] |= uint64_t(1) << (low & 0x3fU);
+    }
+    std::vector<uint16_t>{}.swap(m_array);
+}
+
+int32_t IdSetAdaptive::Chunk::lower_bound(uint32_t low) const noexcept {
+    if (!m_bitmap) {
+        const auto it = std::lower_bound(m_array.begin(), m_array.end(), low);
+        return it == m_array.end() ? -1 : int32_t(*it);
+    }
+
+    std::size_t word = low >> 6U;
+    uint64_t bits = m_bitmap[word] & (~uint64_t(0) << (low & 0x3fU));
+    while (bits == 0) {
+        if (++word == bitmap_words) {
+            return -1;
+        }
+        bits = m_bitmap[word];
+    }
+    return int32_t(word * 64 + lowest_bit(bits));
+}
+
+std::size_t IdSetAdaptive::Chunk::used_memory() const noexcept {
+    return sizeof(Chunk) +
+           m_array.capacity() * sizeof(uint16_t) +
+           (m_bitmap ? bitmap_words * sizeof(uint64_t) : 0);
+}
+
+IdSetAdaptive::Chunk& IdSetAdaptive::new_chunk() {
+    m_chunks.emplace_back();
+    if (m_dense) {
+        m_chunks.back().make_bitmap();
+    }
+    return m_chunks.back();
+}
+
+/*
+
+  The index needs 4 bytes for every possible key up to the largest one.
+  With at least one chunk for every index_density keys, this is small
+  compared to the memory used by the chunks. Without the index, adding a
+  chunk in the middle of the list has to move all chunks after it, so the
+  list must not get too long.
+
+*/
+
+IdSetAdaptive::Chunk& IdSetAdaptive::get_chunk(id_type k) {
+    if (m_use_index) {
+        if (k >= m_index.size()) {
+            if (k >= max_index_keys) {
+                remove_index();
+                return get_chunk(k);
+            }
+            m_index.resize(k + 1, 0);
+        }
+        auto& pos = m_index[k];
+        if (pos == 0) {
+            new_chunk();
+            pos = static_cast<uint32_t>(m_chunks.size());
+        }
+        return m_chunks[pos - 1];
+    }
+
+    const auto it = std::lower_bound(m_keys.begin(), m_keys.end(), k);
+    if (it != m_keys.end() && *it == k) {
+        return m_chunks[std::distance(m_keys.begin(), it)];
+    }
+
+    const id_type max_key = std::max(k, m_keys.empty() ? 0 : m_keys.back());
+    if (max_key < max_index_keys && (m_keys.size() + 1) * index_density > max_key) {
+        build_index();
+        return get_chunk(k);
+    }
+
+    // keys are mostly added in order
+    if (it == m_keys.end()) {
+        m_keys.push_back(k);
+        return new_chunk();
+    }
+
+    const auto n = std::distance(m_keys.begin(), it);
+    m_keys.insert(it, k);
+    m_chunks.insert(m_chunks.begin() + n, Chunk{});
+    if (m_dense) {
+        m_chunks[n].make_bitmap();
+    }
+    return m_chunks[n];
+}
+
+void IdSetAdaptive::build_index() {
+    if (!m_keys.empty()) {
+        m_index.assign(m_keys.back() + 1, 0);
+    }
+    for (std::size_t n = 0; n < m_keys.size(); ++n) {
+        m_index[m_keys[n]] = static_cast<uint32_t>(n + 1);
+    }
+    std::vector<id_type>{}.swap(m_keys);
+    m_use_index = true;
+}
+
+void IdSetAdaptive::remove_index() {
+    std::vector<Chunk> chunks;
+    chunks.reserve(m_chunks.size());
+    for (std::size_t k = 0; k < m_index.size(); ++k) {
+        if (m_index[k] != 0) {
+            m_keys.push_back(k);
+            chunks.push_back(std::move(m_chunks[m_index[k] - 1]));
+        }
+    }
+    m_chunks.swap(chunks);
+    std::vector<uint32_t>{}.swap(m_index);
+    m_use_index = false;
+}
+
+IdSetAdaptive::id_type IdSetAdaptive::lower_bound(id_type id) const noexcept {
+    const auto k = key(id);
+
+    if (m_use_index) {
+        for (auto n = k; n < m_index.size(); ++n) {
+            if (m_index[n] != 0) {
+                const auto r = m_chunks[m_index[n] - 1].lower_bound(n == k ? low(id) : 0);
+                if (r >= 0) {
+                    return (n << chunk_bits) | id_type(r);
+                }
+            }
+        }
+        return no_id;
+    }
+
+    for (auto it = std::lower_bound(m_keys.begin(), m_keys.end(), k); it != m_keys.end(); ++it) {
+        const auto r = m_chunks[std::distance(m_keys.begin(), it)].lower_bound(*it == k ? low(id) : 0);
+        if (r >= 0) {
+            return (*it << chunk_bits) | id_type(r);
+        }
+    }
+    return no_id;
+}
+
+std::size_t IdSetAdaptive::used_memory() const noexcept {
+    std::size_t memory = m_keys.capacity() * sizeof(id_type) +
+                         m_index.capacity() * sizeof(uint32_t);
+    for (const auto& chunk : m_chunks) {
+        memory += chunk.used_memory();
+    }
+    return memory;
+}
+
@@ -0,0 +1,257 @@
+#ifndef EXTRACT_ID_SET_HPP
+#define EXTRACT_ID_SET_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <osmium/osm/types.hpp>
+
+/**
+ * A set of IDs whose memory use is proportional to the number of IDs in
+ * it, not to the largest ID. This is used instead of IdSetDense for the
+ * per-extract ID sets, because there can be hundreds of extracts, most of
+ * them small.
+ *
+ * The ID space is divided into chunks of 2^16 IDs. Each chunk stores its
+ * IDs in a sorted array until it gets too full, then in a bitmap. While
+ * there are only a few chunks compared to the range of IDs used, they
+ * are found by binary search in a sorted list of keys (the upper bits of
+ * the IDs). Once there are more, an index with an entry for every
+ * possible key is used instead.
+ *
+ * IDs can be added while iterating over the set, the iterator will see
+ * new IDs larger than the current one.
+ */
+class IdSetAdaptive {
+
+public:
+
+    using id_type = osmium::unsigned_object_id_type;
+
+    enum : std::size_t {
+        chunk_bits = 16,
+        chunk_size = 1U << chunk_bits,
+        bitmap_words = chunk_size / 64,
+
+        // An array with this many IDs takes up as much memory as a bitmap.
+        max_array_size = chunk_size / 16,
+
+        // Use the index if at least one in this many keys has a chunk.
+        index_density = 32,
+
+        // Keys from this value on are never stored in the index, because
+        // it would get too large.
+        max_index_keys = 1U << 20U
+    };
+
+private:
+
+    class Chunk {
+
+        std::vector<uint16_t> m_array;
+        std::unique_ptr<uint64_t[]> m_bitmap;
+
+    public:
+
+        bool get(uint16_t low) const noexcept {
+            if (m_bitmap) {
+                return (m_bitmap[low >> 6U] & (uint64_t(1) << (low & 0x3fU))) != 0;
+            }
+            return std::binary_search(m_array.begin(), m_array.end(), low);
+        }
+
+        // Returns true if the ID was not in the chunk before.
+        bool set(uint16_t low) {
+            if (m_bitmap) {
+                uint64_t& word = m_bitmap[low >> 6U];
+                const uint64_t bit = uint64_t(1) << (low & 0x3fU);
+                const bool added = (word & bit) == 0;
+                word |= bit;
+                return added;
+            }
+
+            // IDs are mostly added in order
+            if (m_array.empty() || m_array.back() < low) {
+                m_array.push_back(low);
+                return true;
+            }
+
+            const auto it = std::lower_bound(m_array.begin(), m_array.end(), low);
+            if (*it == low) {
+                return false;
+            }
+            m_array.insert(it, low);
+            return true;
+        }
+
+        bool is_full() const noexcept {
+            return m_array.size() > max_array_size;
+        }
+
+        void make_bitmap();
+
+        // The smallest ID in the chunk >= low or -1 if there is none.
+        int32_t lower_bound(uint32_t low) const noexcept;
+
+        std::size_t used_memory() const noexcept;
+
+    }; // class Chunk
+
+    // Without index m_chunks is sorted by key and m_keys contains the
+    // corresponding keys. With index m_keys is empty and m_index[k] is
+    // the position in m_chunks plus one of the chunk with key k or 0 if
+    // there is no such chunk.
+    std::vector<id_type> m_keys;
+    std::vector<uint32_t> m_index;
+    std::vector<Chunk> m_chunks;
+
+    std::size_t m_size = 0;
+    bool m_use_index = false;
+    bool m_dense;
+
+    static id_type key(id_type id) noexcept {
+        return id >> chunk_bits;
+    }
+
+    static uint16_t low(id_type id) noexcept {
+        return static_cast<uint16_t>(id & (chunk_size - 1));
+    }
+
+    Chunk& get_chunk(id_type k);
+
+    Chunk& new_chunk();
+
+    void build_index();
+
+    void remove_index();
+
+    // The smallest ID in the set >= id or no_id if there is none.
+    id_type lower_bound(id_type id) const noexcept;
+
+public:
+
+    static constexpr const id_type no_id = std::numeric_limits<id_type>::max();
+
+    class const_iterator {
+
+        const IdSetAdaptive* m_set;
+        id_type m_value;
+
+    public:
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = id_type;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const id_type*;
+        using reference         = const id_type&;
+
+        const_iterator(const IdSetAdaptive* set, id_type value) noexcept :
+            m_set(set),
+            m_value(value) {
+        }
+
+        const_iterator& operator++() noexcept {
+            m_value = m_set->lower_bound(m_value + 1);
+            return *this;
+        }
+
+        const_iterator operator++(int) noexcept {
+            const_iterator tmp{*this};
+            ++*this;
+            return tmp;
+        }
+
+        reference operator*() const noexcept {
+            return m_value;
+        }
+
+        bool operator==(const const_iterator& rhs) const noexcept {
+            return m_set == rhs.m_set && m_value == rhs.m_value;
+        }
+
+        bool operator!=(const const_iterator& rhs) const noexcept {
+            return !(*this == rhs);
+        }
+
+    }; // class const_iterator
+
+    /**
+     * Create an empty set. If dense is set, all chunks are bitmaps from
+     * the start. This uses a lot more memory for small sets, but is a bit
+     * faster for large ones.
+     */
+    explicit IdSetAdaptive(bool dense = false) noexcept :
+        m_dense(dense) {
+    }
+
+    bool get(id_type id) const noexcept {
+        const auto k = key(id);
+        if (m_use_index) {
+            return k < m_index.size() && m_index[k] != 0 &&
+                   m_chunks[m_index[k] - 1].get(low(id));
+        }
+
+        const auto it = std::lower_bound(m_keys.begin(), m_keys.end(), k);
+        return it != m_keys.end() && *it == k &&
+               m_chunks[std::distance(m_keys.begin(), it)].get(low(id));
+    }
+
+    void set(id_type id) {
+        Chunk& chunk = get_chunk(key(id));
+        if (chunk.set(low(id))) {
+            ++m_size;
+            if (chunk.is_full()) {
+                chunk.make_bitmap();
+            }
+        }
+    }
+
+    bool empty() const noexcept {
+        return m_size == 0;
+    }
+
+    std::size_t size() const noexcept {
+        return m_size;
+    }
+
+    /// The memory used by this set in bytes (approximately).
+    std::size_t used_memory() const noexcept;
+
+    const_iterator begin() const noexcept {
+        return const_iterator{this, lower_bound(0)};
+    }
+
+    const_iterator end() const noexcept {
+        return const_iterator{this, no_id};
+    }
+
+}; // class IdSetAdaptive
+
+#endif // EXTRACT_ID_SET_HPP
@@ -0,0 +1,275 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/segment.hpp>
+
+#include "point_in_polygon.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define EXTRACT_PIP_X86 1
+# include <immintrin.h>
+#endif
+
+void SegmentBand::add(const osmium::Segment& segment) {
+    x1.push_back(segment.first().x());
+    y1.push_back(segment.first().y());
+    x2.push_back(segment.second().x());
+    y2.push_back(segment.second().y());
+}
+
+namespace {
+
+    // Test the segments [n, band.size()) of the band one by one. Returns
+    // -1 if the location is on an end point of a segment, otherwise the
+    // number of segments crossed modulo 2.
+    int scalar_parity(const SegmentBand& band, const osmium::Location& location, std::size_t n) noexcept {
+        const int32_t lx = location.x();
+        const int32_t ly = location.y();
+
+        int inside = 0;
+        for (; n < band.size(); ++n) {
+            if ((band.x1[n] == lx && band.y1[n] == ly) ||
+                (band.x2[n] == lx && band.y2[n] == ly)) {
+                return -1;
+            }
+            if ((band.y2[n] > ly) != (band.y1[n] > ly)) {
+                const int64_t ax = int64_t(band.x1[n]) - int64_t(band.x2[n]);
+                const int64_t ay = int64_t(band.y1[n]) - int64_t(band.y2[n]);
+                const int64_t tx = int64_t(lx)         - int64_t(band.x2[n]);
+                const int64_t ty = int64_t(ly)         - int64_t(band.y2[n]);
+
+                const bool comp = tx * ay < ax * ty;
+
+                if ((ay > 0) == comp) {
+                    inside ^= 1;
+                }
+            }
+        }
+
+        return inside;
+    }
+
+    bool scalar_kernel(const SegmentBand& band, const osmium::Location& location) noexcept {
+        return scalar_parity(band, location, 0) != 0;
+    }
+
+#ifdef EXTRACT_PIP_X86
+
+    // The SIMD kernels do the same as the scalar kernel on two or four
+    // segments at once using 64 bit lanes. The products are calculated
+    // with the 32x32->64 bit signed multiplication, which is exact
+    // because all coordinate differences fit into 32 bits (see
+    // best_pip_kernel()).
+
+    __attribute__((target("sse4.2")))
+    bool sse42_kernel(const SegmentBand& band, const osmium::Location& location) noexcept {
+        const __m128i lx = _mm_set1_epi64x(location.x());
+        const __m128i ly = _mm_set1_epi64x(location.y());
+        const __m128i zero = _mm_setzero_si128();
+
+        unsigned int crossings = 0;
+        std::size_t n = 0;
+        for (; n + 2 <= band.size(); n += 2) {
+            const __m128i x1 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&band.x1[n])));
+            const __m128i y1 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&band.y1[n])));
+            const __m128i x2 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&band.x2[n])));
+            const __m128i y2 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&band.y2[n])));
+
+            const __m128i on_vertex = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi64(x1, lx), _mm_cmpeq_epi64(y1, ly)),
+                                                   _mm_and_si128(_mm_cmpeq_epi64(x2, lx), _mm_cmpeq_epi64(y2, ly)));
+            if (_mm_movemask_pd(_mm_castsi128_pd(on_vertex))) {
+                return true;
+            }
+
+            const __m128i y_crossed = _mm_xor_si128(_mm_cmpgt_epi64(y2, ly), _mm_cmpgt_epi64(y1, ly));
+
+            const __m128i ax = _mm_sub_epi64(x1, x2);
+            const __m128i ay = _mm_sub_epi64(y1, y2);
+            const __m128i tx = _mm_sub_epi64(lx, x2);
+            const __m128i ty = _mm_sub_epi64(ly, y2);
+
+            const __m128i comp = _mm_cmpgt_epi64(_mm_mul_epi32(ax, ty), _mm_mul_epi32(tx, ay));
+            const __m128i ay_positive = _mm_cmpgt_epi64(ay, zero);
+
+            // y_crossed && (ay_positive == comp)
+            const __m128i flip = _mm_andnot_si128(_mm_xor_si128(ay_positive, comp), y_crossed);
+            crossings += std::bitset<2>(static_cast<unsigned int>(_mm_movemask_pd(_mm_castsi128_pd(flip)))).count();
+        }
+
+        const int rest = scalar_parity(band, location, n);
+        if (rest < 0) {
+            return true;
+        }
+        return ((crossings + static_cast<unsigned int>(rest)) & 1U) != 0;
+    }
+
+    __attribute__((target("avx2")))
+    bool avx2_kernel(const SegmentBand& band, const osmium::Location& location) noexcept {
+        const __m256i lx = _mm256_set1_epi64x(location.x());
+        const __m256i ly = _mm256_set1_epi64x(location.y());
+        const __m256i zero = _mm256_setzero_si256();
+
+        unsigned int crossings = 0;
+        std::size_t n = 0;
+        for (; n + 4 <= band.size(); n += 4) {
+            const __m256i x1 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&band.x1[n])));
+            const __m256i y1 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&band.y1[n])));
+            const __m256i x2 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&band.x2[n])));
+            const __m256i y2 = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&band.y2[n])));
+
+            const __m256i on_vertex = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi64(x1, lx), _mm256_cmpeq_epi64(y1, ly)),
+                                                      _mm256_and_si256(_mm256_cmpeq_epi64(x2, lx), _mm256_cmpeq_epi64(y2, ly)));
+            if (_mm256_movemask_pd(_mm256_castsi256_pd(on_vertex))) {
+                return true;
+            }
+
+            const __m256i y_crossed = _mm256_xor_si256(_mm256_cmpgt_epi64(y2, ly), _mm256_cmpgt_epi64(y1, ly));
+
+            const __m256i ax = _mm256_sub_epi64(x1, x2);
+            const __m256i ay = _mm256_sub_epi64(y1, y2);
+            const __m256i tx = _mm256_sub_epi64(lx, x2);
+            const __m256i ty = _mm256_sub_epi64(ly, y2);
+
+            const __m256i comp = _mm256_cmpgt_epi64(_mm256_mul_epi32(ax, ty), _mm256_mul_epi32(tx, ay));
+            const __m256i ay_positive = _mm256_cmpgt_epi64(ay, zero);
+
+            // y_crossed && (ay_positive == comp)
+            const __m256i flip = _mm256_andnot_si256(_mm256_xor_si256(ay_positive, comp), y_crossed);
+            crossings += std::bitset<4>(static_cast<unsigned int>(_mm256_movemask_pd(_mm256_castsi256_pd(flip)))).count();
+        }
+
+        const int rest = scalar_parity(band, location, n);
+        if (rest < 0) {
+            return true;
+        }
+        return ((crossings + static_cast<unsigned int>(rest)) & 1U) != 0;
+    }
+
+    bool cpu_supports(pip_kernel kernel) noexcept {
+        __builtin_cpu_init();
+        switch (kernel) {
+            case pip_kernel::sse42:
+                return __builtin_cpu_supports("sse4.2");
+            case pip_kernel::avx2:
+                return __builtin_cpu_supports("avx2");
+            default:
+                break;
+        }
+        return true;
+    }
+
+#else
+
+    bool cpu_supports(pip_kernel kernel) noexcept {
+        return kernel == pip_kernel::scalar;
+    }
+
+#endif
+
+    PolygonBands::kernel_func get_kernel(pip_kernel kernel) noexcept {
+        switch (kernel) {
+#ifdef EXTRACT_PIP_X86
+            case pip_kernel::sse42:
+                return sse42_kernel;
+            case pip_kernel::avx2:
+                return avx2_kernel;
+#endif
+            default:
+                break;
+        }
+        return scalar_kernel;
+    }
+
+} // anonymous namespace
+
+const char* pip_kernel_name(pip_kernel kernel) noexcept {
+    switch (kernel) {
+        case pip_kernel::sse42:
+            return "sse4.2";
+        case pip_kernel::avx2:
+            return "avx2";
+        default:
+            break;
+    }
+    return "scalar";
+}
+
+std::vector<pip_kernel> available_pip_kernels() {
+    std::vector<pip_kernel> kernels;
+    for (const auto kernel : {pip_kernel::scalar, pip_kernel::sse42, pip_kernel::avx2}) {
+        if (cpu_supports(kernel)) {
+            kernels.push_back(kernel);
+        }
+    }
+    return kernels;
+}
+
+pip_kernel best_pip_kernel(const osmium::Box& envelope) {
+    constexpr const int64_t max_size = (1LL << 31) - 1;
+    const int64_t width  = int64_t(envelope.top_right().x()) - int64_t(envelope.bottom_left().x());
+    const int64_t height = int64_t(envelope.top_right().y()) - int64_t(envelope.bottom_left().y());
+    if (width > max_size || height > max_size) {
+        return pip_kernel::scalar;
+    }
+
+    return available_pip_kernels().back();
+}
+
+PolygonBands::PolygonBands(const std::vector<osmium::Segment>& segments, const osmium::Box& envelope, pip_kernel kernel) :
+    m_bands(),
+    m_y_min(envelope.bottom_left().y()),
+    m_kernel(get_kernel(kernel)) {
+
+    // split y range into equal-sized bands
+    constexpr const int32_t segments_per_band = 10;
+    constexpr const int32_t max_bands = 10000;
+    int32_t num_bands = static_cast<int32_t>(segments.size()) / segments_per_band;
+    if (num_bands < 1) {
+        num_bands = 1;
+    } else if (num_bands > max_bands) {
+        num_bands = max_bands;
+    }
+
+    m_bands.resize(num_bands);
+
+    m_dy = std::max(1, (envelope.top_right().y() - m_y_min) / num_bands);
+
+    // put segments into the bands they overlap
+    for (const auto& segment : segments) {
+        const std::pair<int32_t, int32_t> mm = std::minmax(segment.first().y(), segment.second().y());
+        const uint32_t band_min = (mm.first  - m_y_min) / m_dy;
+        const uint32_t band_max = std::min(num_bands, ((mm.second - m_y_min) / m_dy) + 1);
+
+        for (auto band = band_min; band < band_max; ++band) {
+            m_bands[band].add(segment);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef EXTRACT_POINT_IN_POLYGON_HPP
+#define EXTRACT_POINT_IN_POLYGON_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+
+namespace osmium {
+    class Segment;
+}
+
+/**
+ * The different implementations of the point-in-polygon test for the
+ * segments in one band of a polygon. The SIMD implementations are only
+ * available on x86 CPUs supporting the instructions and when compiling
+ * with GCC or clang.
+ */
+enum class pip_kernel {
+    scalar,
+    sse42,
+    avx2
+};
+
+const char* pip_kernel_name(pip_kernel kernel) noexcept;
+
+/// All kernels that can be used on this CPU.
+std::vector<pip_kernel> available_pip_kernels();
+
+/**
+ * The fastest kernel available on this CPU that can be used for a
+ * polygon with the given envelope. The SIMD kernels multiply coordinate
+ * differences as 32 bit integers, so they only work if the width and
+ * height of the envelope fit into 31 bits.
+ */
+pip_kernel best_pip_kernel(const osmium::Box& envelope);
+
+/**
+ * The segments in one band of a polygon in structure-of-arrays layout,
+ * so that several segments can be tested with one instruction.
+ */
+struct SegmentBand {
+    std::vector<int32_t> x1;
+    std::vector<int32_t> y1;
+    std::vector<int32_t> x2;
+    std::vector<int32_t> y2;
+
+    void add(const osmium::Segment& segment);
+
+    std::size_t size() const noexcept {
+        return x1.size();
+    }
+};
+
+/**
+ * Point-in-polygon test for a polygon given as a list of segments.
+ *
+ * Uses the algorithm from
+ * https://www.ecse.rpi.edu/Homepages/wrf/Research/Short_Notes/pnpoly.html
+ *
+ *     int pnpoly(int nvert, float *vertx, float *verty, float testx, float testy)
+ *     {
+ *         int i, j, c = 0;
+ *         for (i = 0, j = nvert-1; i < nvert; j = i++) {
+ *             if ( ((verty[i]>testy) != (verty[j]>testy)) &&
+ *                 (testx < (vertx[j]-vertx[i]) * (testy-verty[i]) / (verty[j]-verty[i]) + vertx[i]) )
+ *             c = !c;
+ *         }
+ *         return c;
+ *     }
+ *
+ * The y range of the envelope is split into equal-sized bands and only
+ * the segments in the band that contains the y coordinate of a location
+ * have to be tested. Locations on a vertex of the polygon are inside.
+ */
+class PolygonBands {
+
+public:
+
+    using kernel_func = bool (*)(const SegmentBand& band, const osmium::Location& location) noexcept;
+
+private:
+
+    std::vector<SegmentBand> m_bands;
+    int32_t m_y_min;
+    int32_t m_dy = 1;
+    kernel_func m_kernel;
+
+public:
+
+    PolygonBands(const std::vector<osmium::Segment>& segments, const osmium::Box& envelope, pip_kernel kernel);
+
+    /// The location must be inside the envelope.
+    bool contains(const osmium::Location& location) const noexcept {
+        std::size_t band = (location.y() - m_y_min) / m_dy;
+        if (band >= m_bands.size()) {
+            band = m_bands.size() - 1;
+        }
+        return m_kernel(m_bands[band], location);
+    }
+
+}; // class PolygonBands
+
+#endif // EXTRACT_POINT_IN_POLYGON_HPP
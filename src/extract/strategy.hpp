@@ -23,22 +23,39 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <osmium/io/file.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
 #include <osmium/memory/buffer.hpp>
 #include <osmium/memory/item.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
 #include <osmium/osm/node.hpp>
 #include <osmium/osm/object.hpp>
 #include <osmium/osm/relation.hpp>
 #include <osmium/osm/types.hpp>
 #include <osmium/osm/way.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/util/options.hpp>
 #include <osmium/util/progress_bar.hpp>
 #include <osmium/util/verbose_output.hpp>
 
+#include "envelope_grid.hpp"
 #include "extract.hpp"
+#include "../exception.hpp"
+#include "../spill_file.hpp"
 
 template <typename T>
 class ExtractData : public T {
@@ -47,8 +64,9 @@ class ExtractData : public T {
 
 public:
 
-    explicit ExtractData(Extract& extract) :
-        T(),
+    template <typename... TArgs>
+    explicit ExtractData(Extract& extract, TArgs&&... args) :
+        T(std::forward<TArgs>(args)...),
         m_extract_ptr(&extract) {
     }
 
@@ -56,6 +74,18 @@ public:
         return m_extract_ptr->contains(location);
     }
 
+    void classify(const osmium::Location* first, const osmium::Location* last, unsigned char* inside) const noexcept {
+        m_extract_ptr->classify(first, last, inside);
+    }
+
+    const osmium::Box& envelope() const noexcept {
+        return m_extract_ptr->envelope();
+    }
+
+    const Extract& extract() const noexcept {
+        return *m_extract_ptr;
+    }
+
     void write(const osmium::memory::Item& item) {
         m_extract_ptr->write(item);
     }
@@ -69,6 +99,23 @@ public:
 
 class ExtractStrategy {
 
+    unsigned int m_num_threads = 1;
+
+protected:
+
+    // Returns true if the "id-sets" option asks for dense ID sets instead
+    // of the default adaptive ones (see IdSetAdaptive).
+    static bool dense_id_sets(const osmium::util::Options& options) {
+        const std::string id_sets{options.get("id-sets", "adaptive")};
+        if (id_sets == "dense") {
+            return true;
+        }
+        if (id_sets != "adaptive") {
+            throw argument_error{"Unknown value for strategy option 'id-sets': '" + id_sets + "'. Use 'adaptive' or 'dense'."};
+        }
+        return false;
+    }
+
 public:
 
     ExtractStrategy() = default;
@@ -80,50 +127,432 @@ public:
     virtual void show_arguments(osmium::util::VerboseOutput& /*vout*/) {
     }
 
+    // The maximum number of threads used to work on the extracts.
+    unsigned int num_threads() const noexcept {
+        return m_num_threads;
+    }
+
+    void set_num_threads(unsigned int num_threads) noexcept {
+        m_num_threads = num_threads;
+    }
+
     virtual void run(osmium::util::VerboseOutput& vout, bool display_progress, const osmium::io::File& input_file) = 0;
 
 }; // class ExtractStrategy
 
-
+/**
+ * One pass through the input file. For each object in the input the
+ * functions node(), way(), or relation() are called once and then the
+ * functions enode(), eway(), or erelation() are called for each extract.
+ *
+ * Each buffer read from the input is worked on in two steps: First the
+ * node(), way(), and relation() functions are called for all objects in
+ * the buffer. Then the extracts are split up into groups, one per thread,
+ * and the functions enode(), eway(), and erelation() are called for all
+ * objects in the buffer and all extracts in a group. So these functions
+ * must only change data belonging to the extract they are called for,
+ * they must not rely on node(), way(), or relation() having been called
+ * for the same object just before, and they must not change any data
+ * of the pass.
+ *
+ * If a pass sets dispatch_nodes_by_location to true, enode() is only
+ * called for the extracts that contain the node location. Use this for
+ * passes that don't do anything in enode() for nodes outside an extract.
+ * The nodes in a buffer are classified in batches: While going through
+ * the objects, the extracts whose envelope contains the node location
+ * are found with an EnvelopeGrid for each node, so the work needed per
+ * node doesn't grow with the number of extracts. Then for each extract
+ * the locations of all its candidate nodes are collected into an array
+ * and checked with Extract::classify() in one go, and enode() is called
+ * for the nodes inside the extract, still in the order of the input.
+ *
+ * Extracts can have a parent extract (see Extract::parent()). For those
+ * the grid isn't used, instead only the nodes inside the parent extract
+ * are checked. So with nested extracts, for instance continents,
+ * countries, and provinces, the work per node depends on the depth of
+ * the nesting and not on the number of extracts. Nodes outside the
+ * parent are never in the child extract, even if they are inside its
+ * geometry. To make this work, the extracts are worked on in an order
+ * where each parent comes before its children, and children are always
+ * in the same group as their parent.
+ *
+ * After all extracts are done with a buffer, buffer_done() is called.
+ * Like node(), way(), and relation() it is called from one thread only, so
+ * it can collect data from all extracts.
+ *
+ * A pass reading the whole input can copy the ways and relations into a
+ * spool (see spool_to()). Later passes can then use run_with_spool() or
+ * run_spool() to get the ways and relations from there instead of reading
+ * and decoding them again from the input. This only works for sorted
+ * input files where all nodes come before the ways and relations, which
+ * is checked in the first pass of the strategies using this.
+ */
 template <typename TStrategy, typename TChild>
 class Pass {
 
+    static constexpr const std::size_t no_parent = static_cast<std::size_t>(-1);
+
     TStrategy& m_strategy;
+    EnvelopeGrid m_grid;
+    SpillFile* m_spool = nullptr;
+
+    // The index of the parent of each extract (only if
+    // dispatch_nodes_by_location is set, otherwise all are no_parent),
+    // the order in which the extracts are worked on, and the groups of
+    // extracts worked on by different threads as ranges in m_order.
+    std::vector<std::size_t> m_parents;
+    std::vector<std::size_t> m_order;
+    std::vector<std::pair<std::size_t, std::size_t>> m_groups;
+
+    // Threads working on all groups but the first. Started once for the
+    // pass and used for all buffers.
+    std::unique_ptr<osmium::thread::Pool> m_pool;
+
+    // Filled in run_objects() if dispatch_nodes_by_location is set: All
+    // nodes in the current buffer and for each extract the indexes (into
+    // m_nodes) of the nodes whose location is inside the envelope of the
+    // extract.
+    std::vector<const osmium::Node*> m_nodes;
+    std::vector<std::vector<uint32_t>> m_node_candidates;
+
+    // The indexes of the nodes found to be inside each extract in the
+    // last batch. Used for the child extracts.
+    std::vector<std::vector<uint32_t>> m_accepted;
+
+    void add_node_candidates(const osmium::Node& node) {
+        const auto index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.push_back(&node);
+        const auto candidates = m_grid.candidates(node.location());
+        for (auto it = candidates.first; it != candidates.second; ++it) {
+            m_node_candidates[*it].push_back(index);
+        }
+    }
 
-    void run_impl(osmium::ProgressBar& progress_bar, osmium::io::Reader& reader) {
-        while (osmium::memory::Buffer buffer = reader.read()) {
-            progress_bar.update(reader.offset());
-            for (const auto& object : buffer) {
-                switch (object.type()) {
-                    case osmium::item_type::node:
-                        self().node(static_cast<const osmium::Node&>(object));
-                        for (auto& e : extracts()) {
-                            self().enode(e, static_cast<const osmium::Node&>(object));
-                        }
-                        break;
-                    case osmium::item_type::way:
-                        self().way(static_cast<const osmium::Way&>(object));
-                        for (auto& e : extracts()) {
-                            self().eway(e, static_cast<const osmium::Way&>(object));
-                        }
-                        break;
-                    case osmium::item_type::relation:
-                        self().relation(static_cast<const osmium::Relation&>(object));
-                        for (auto& e : extracts()) {
-                            self().erelation(e, static_cast<const osmium::Relation&>(object));
+    void run_objects(const osmium::memory::Buffer& buffer) {
+        if (TChild::dispatch_nodes_by_location) {
+            m_nodes.clear();
+            for (auto& candidates : m_node_candidates) {
+                candidates.clear();
+            }
+        }
+
+        for (const auto& object : buffer) {
+            switch (object.type()) {
+                case osmium::item_type::node:
+                    self().node(static_cast<const osmium::Node&>(object));
+                    if (TChild::dispatch_nodes_by_location) {
+                        add_node_candidates(static_cast<const osmium::Node&>(object));
+                    }
+                    break;
+                case osmium::item_type::way:
+                    self().way(static_cast<const osmium::Way&>(object));
+                    break;
+                case osmium::item_type::relation:
+                    self().relation(static_cast<const osmium::Relation&>(object));
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Scratch space for classify_nodes(), one per thread.
+    struct node_batch {
+        std::vector<osmium::Location> locations;
+        std::vector<unsigned char> inside;
+    };
+
+    // Classify the nodes with the indexes (into m_nodes) in [first, last)
+    // for extract n and call enode() for the nodes inside the extract.
+    void classify_nodes(std::size_t n, const uint32_t* first, const uint32_t* last, node_batch& batch) {
+        auto& accepted = m_accepted[n];
+        accepted.clear();
+        if (first == last) {
+            return;
+        }
+
+        batch.locations.clear();
+        for (auto it = first; it != last; ++it) {
+            batch.locations.push_back(m_nodes[*it]->location());
+        }
+
+        batch.inside.resize(batch.locations.size());
+        auto& e = extracts()[n];
+        e.classify(batch.locations.data(), batch.locations.data() + batch.locations.size(), batch.inside.data());
+
+        for (std::size_t i = 0; i < batch.inside.size(); ++i) {
+            if (batch.inside[i]) {
+                accepted.push_back(first[i]);
+                self().enode(e, *m_nodes[first[i]]);
+            }
+        }
+    }
+
+    // Classify the nodes up to (not including) the node with index end
+    // in m_nodes for the extracts in [first, last) of m_order. For
+    // extracts without parent the nodes are taken from the candidate
+    // list starting at the position in positions, which is updated.
+    void classify_nodes(std::size_t first, std::size_t last, std::vector<std::size_t>& positions, std::size_t end, node_batch& batch) {
+        for (std::size_t i = first; i < last; ++i) {
+            const std::size_t n = m_order[i];
+            if (m_parents[n] != no_parent) {
+                const auto& accepted = m_accepted[m_parents[n]];
+                classify_nodes(n, accepted.data(), accepted.data() + accepted.size(), batch);
+                continue;
+            }
+
+            const auto& candidates = m_node_candidates[n];
+            auto& pos = positions[i - first];
+            const auto begin = pos;
+            while (pos < candidates.size() && candidates[pos] < end) {
+                ++pos;
+            }
+            classify_nodes(n, candidates.data() + begin, candidates.data() + pos, batch);
+        }
+    }
+
+    void run_extracts(const osmium::memory::Buffer& buffer, std::size_t first, std::size_t last) {
+        // For dispatch_nodes_by_location: The position in the candidate
+        // list of each extract up to which nodes have been handled and
+        // the number of nodes seen so far. Nodes are handled in batches
+        // when the first object that is not a node is found after some
+        // nodes and at the end of the buffer. In sorted input that is
+        // only once per buffer.
+        std::vector<std::size_t> positions(last - first, 0);
+        std::size_t num_nodes = 0;
+        std::size_t nodes_done = 0;
+        node_batch batch;
+        const auto flush_nodes = [&]() {
+            if (num_nodes != nodes_done) {
+                classify_nodes(first, last, positions, num_nodes, batch);
+                nodes_done = num_nodes;
+            }
+        };
+
+        for (const auto& object : buffer) {
+            switch (object.type()) {
+                case osmium::item_type::node:
+                    if (TChild::dispatch_nodes_by_location) {
+                        ++num_nodes;
+                    } else {
+                        for (std::size_t i = first; i < last; ++i) {
+                            self().enode(extracts()[m_order[i]], static_cast<const osmium::Node&>(object));
                         }
+                    }
+                    break;
+                case osmium::item_type::way:
+                    flush_nodes();
+                    for (std::size_t i = first; i < last; ++i) {
+                        self().eway(extracts()[m_order[i]], static_cast<const osmium::Way&>(object));
+                    }
+                    break;
+                case osmium::item_type::relation:
+                    flush_nodes();
+                    for (std::size_t i = first; i < last; ++i) {
+                        self().erelation(extracts()[m_order[i]], static_cast<const osmium::Relation&>(object));
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        flush_nodes();
+    }
+
+    // Put the extracts in an order where all children of an extract
+    // directly follow it and split them up into groups for the threads.
+    void make_order_and_groups() {
+        const std::size_t size = extracts().size();
+
+        m_parents.assign(size, no_parent);
+        if (TChild::dispatch_nodes_by_location) {
+            for (std::size_t n = 0; n < size; ++n) {
+                const Extract* parent = extracts()[n].extract().parent();
+                for (std::size_t p = 0; p < size && parent; ++p) {
+                    if (&extracts()[p].extract() == parent) {
+                        m_parents[n] = p;
                         break;
-                    default:
-                        break;
+                    }
                 }
             }
         }
+
+        std::vector<std::vector<std::size_t>> children(size);
+        for (std::size_t n = 0; n < size; ++n) {
+            if (m_parents[n] != no_parent) {
+                children[m_parents[n]].push_back(n);
+            }
+        }
+
+        m_order.clear();
+        std::vector<std::size_t> stack;
+        for (std::size_t n = 0; n < size; ++n) {
+            if (m_parents[n] != no_parent) {
+                continue;
+            }
+            stack.push_back(n);
+            while (!stack.empty()) {
+                const std::size_t e = stack.back();
+                stack.pop_back();
+                m_order.push_back(e);
+                stack.insert(stack.end(), children[e].rbegin(), children[e].rend());
+            }
+        }
+        assert(m_order.size() == size);
+
+        // Groups are split where possible, but never between an extract
+        // and its children.
+        const std::size_t num_groups = std::min(static_cast<std::size_t>(m_strategy.num_threads()), size);
+        m_groups.clear();
+        std::size_t first = 0;
+        for (std::size_t i = 1; i <= num_groups; ++i) {
+            std::size_t last = size * i / num_groups;
+            while (last < size && m_parents[m_order[last]] != no_parent) {
+                ++last;
+            }
+            if (last > first) {
+                m_groups.emplace_back(first, last);
+                first = last;
+            }
+        }
+    }
+
+    void prepare() {
+        make_order_and_groups();
+
+        if (m_groups.size() > 1 && !m_pool) {
+            m_pool.reset(new osmium::thread::Pool{static_cast<int>(m_groups.size() - 1)});
+        }
+
+        // Only extracts without a parent are put into the grid.
+        if (TChild::dispatch_nodes_by_location) {
+            std::vector<osmium::Box> envelopes;
+            for (std::size_t n = 0; n < extracts().size(); ++n) {
+                envelopes.push_back(m_parents[n] == no_parent ? extracts()[n].envelope() : osmium::Box{});
+            }
+            m_grid = EnvelopeGrid{envelopes};
+            m_node_candidates.resize(extracts().size());
+            m_accepted.resize(extracts().size());
+        }
+    }
+
+    // Copy the ways and relations in the buffer into the spool.
+    void spool_objects(const osmium::memory::Buffer& buffer) {
+        const auto is_node = [](const osmium::memory::Item& item) {
+            return item.type() == osmium::item_type::node;
+        };
+        if (std::all_of(buffer.begin(), buffer.end(), is_node)) {
+            return;
+        }
+
+        osmium::memory::Buffer spool_buffer{buffer.committed(), osmium::memory::Buffer::auto_grow::no};
+        for (const auto& item : buffer) {
+            if (item.type() == osmium::item_type::way || item.type() == osmium::item_type::relation) {
+                spool_buffer.add_item(item);
+                spool_buffer.commit();
+            }
+        }
+        m_spool->write(spool_buffer);
+    }
+
+    void run_buffer(const osmium::memory::Buffer& buffer) {
+        run_objects(buffer);
+
+        if (m_spool) {
+            spool_objects(buffer);
+        }
+
+        if (m_groups.size() <= 1) {
+            run_extracts(buffer, 0, extracts().size());
+            self().buffer_done();
+            return;
+        }
+
+        // The first group is done in this thread, the others are
+        // submitted to the thread pool. Each extract is always in the
+        // same group, but might be worked on by a different thread
+        // for each buffer. This is fine, because the tasks for a
+        // buffer are all finished before the next buffer is read.
+        std::vector<std::future<void>> results;
+        for (auto it = std::next(m_groups.cbegin()); it != m_groups.cend(); ++it) {
+            const std::size_t first = it->first;
+            const std::size_t last = it->second;
+            results.push_back(m_pool->submit([this, &buffer, first, last]() {
+                run_extracts(buffer, first, last);
+            }));
+        }
+        std::exception_ptr error;
+        try {
+            run_extracts(buffer, m_groups.front().first, m_groups.front().second);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        // Wait for all tasks before rethrowing any exception, because they
+        // use the buffer.
+        for (auto& result : results) {
+            try {
+                result.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        self().buffer_done();
+    }
+
+    template <typename TReader>
+    void run_impl(osmium::ProgressBar& progress_bar, TReader& reader) {
+        prepare();
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            progress_bar.update(reader.offset());
+            run_buffer(buffer);
+        }
+    }
+
+    // Work on the nodes from the reader. Stops reading at the first
+    // object that is not a node.
+    void run_nodes_impl(osmium::ProgressBar& progress_bar, osmium::io::Reader& reader) {
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            progress_bar.update(reader.offset());
+            const auto it = std::find_if(buffer.begin(), buffer.end(), [](const osmium::memory::Item& item) {
+                return item.type() != osmium::item_type::node;
+            });
+            if (it == buffer.end()) {
+                run_buffer(buffer);
+                continue;
+            }
+
+            osmium::memory::Buffer nodes_buffer{buffer.committed(), osmium::memory::Buffer::auto_grow::no};
+            for (auto nit = buffer.begin(); nit != it; ++nit) {
+                nodes_buffer.add_item(*nit);
+                nodes_buffer.commit();
+            }
+            run_buffer(nodes_buffer);
+            return;
+        }
+    }
+
+    void run_spool_impl(SpillFile& spool) {
+        spool.rewind();
+        while (osmium::memory::Buffer buffer = spool.read()) {
+            run_buffer(buffer);
+        }
     }
 
 protected:
 
     using extract_data = typename TStrategy::extract_data;
 
+    static constexpr const bool dispatch_nodes_by_location = false;
+
     TStrategy& strategy() {
         return m_strategy;
     }
@@ -154,12 +583,23 @@ protected:
     void erelation(extract_data&, const osmium::Relation&) {
     }
 
+    void buffer_done() {
+    }
+
 public:
 
     explicit Pass(TStrategy& strategy) :
         m_strategy(strategy) {
     }
 
+    /**
+     * Copy all ways and relations read in this pass into the spool. The
+     * spool must stay around until all passes using it are done.
+     */
+    void spool_to(SpillFile& spool) noexcept {
+        m_spool = &spool;
+    }
+
     template <typename... Args>
     void run(osmium::ProgressBar& progress_bar, Args ...args) {
         osmium::io::Reader reader{std::forward<Args>(args)...};
@@ -167,7 +607,41 @@ public:
         reader.close();
     }
 
+    /**
+     * Run this pass on the buffers from some other reader. It must have
+     * the read() and offset() functions like osmium::io::Reader.
+     */
+    template <typename TReader>
+    void run_reader(osmium::ProgressBar& progress_bar, TReader& reader) {
+        run_impl(progress_bar, reader);
+    }
+
+    /**
+     * Run this pass on the nodes read from the input and on the ways and
+     * relations from the spool filled in an earlier pass. The input is
+     * only read up to the first way or relation.
+     */
+    template <typename... Args>
+    void run_with_spool(osmium::ProgressBar& progress_bar, SpillFile& spool, Args ...args) {
+        prepare();
+        osmium::io::Reader reader{std::forward<Args>(args)...};
+        run_nodes_impl(progress_bar, reader);
+        reader.close();
+        run_spool_impl(spool);
+    }
+
+    /**
+     * Run this pass on the ways and relations from the spool filled in
+     * an earlier pass only.
+     */
+    void run_spool(SpillFile& spool) {
+        prepare();
+        run_spool_impl(spool);
+    }
+
 }; // class Pass
 
+template <typename TStrategy, typename TChild>
+constexpr const std::size_t Pass<TStrategy, TChild>::no_parent;
 
 #endif // EXTRACT_STRATEGY_HPP
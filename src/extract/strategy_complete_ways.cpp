@@ -20,14 +20,24 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <memory>
+
 #include <osmium/handler/check_order.hpp>
 #include <osmium/util/file.hpp>
 
 #include "strategy_complete_ways.hpp"
+#include "../spill_file.hpp"
 #include "../util.hpp"
 
 namespace strategy_complete_ways {
 
+    Data::Data(bool dense_id_sets) :
+        node_ids(dense_id_sets),
+        extra_node_ids(dense_id_sets),
+        way_ids(dense_id_sets),
+        relation_ids(dense_id_sets) {
+    }
+
     void Data::add_relation_parents(osmium::unsigned_object_id_type id, const osmium::index::RelationsMapIndex& map) {
         map.for_each_parent(id, [&](osmium::unsigned_object_id_type parent_id) {
             if (! relation_ids.get(parent_id)) {
@@ -38,21 +48,33 @@ namespace strategy_complete_ways {
     }
 
     Strategy::Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options) :
-        ExtractStrategy() {
+        ExtractStrategy(),
+        m_dense_id_sets(dense_id_sets(options)) {
         m_extracts.reserve(extracts.size());
         for (const auto& extract : extracts) {
-            m_extracts.emplace_back(*extract);
+            m_extracts.emplace_back(*extract, m_dense_id_sets);
         }
 
         for (const auto& option : options) {
-            warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'complete_ways' strategy.\n");
+            if (std::string{"spool"} != option.first && std::string{"id-sets"} != option.first) {
+                warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'complete_ways' strategy.\n");
+            }
         }
+
+        m_spool = options.is_true("spool");
     }
 
     const char* Strategy::name() const noexcept {
         return "complete_ways";
     }
 
+    void Strategy::show_arguments(osmium::util::VerboseOutput& vout) {
+        vout << "Additional strategy options:\n";
+        vout << "  spool: " << yes_no(m_spool);
+        vout << "  id-sets: " << (m_dense_id_sets ? "dense" : "adaptive") << '\n';
+        vout << '\n';
+    }
+
     class Pass1 : public Pass<Strategy, Pass1> {
 
         osmium::handler::CheckOrder m_check_order;
@@ -60,6 +82,8 @@ namespace strategy_complete_ways {
 
     public:
 
+        static constexpr const bool dispatch_nodes_by_location = true;
+
         Pass1(Strategy& strategy) :
             Pass(strategy) {
         }
@@ -68,10 +92,9 @@ namespace strategy_complete_ways {
             m_check_order.node(node);
         }
 
+        // only called for nodes inside the extract
         void enode(extract_data& e, const osmium::Node& node) {
-            if (e.contains(node.location())) {
-                e.node_ids.set(node.positive_id());
-            }
+            e.node_ids.set(node.positive_id());
         }
 
         void way(const osmium::Way& way) {
@@ -156,11 +179,27 @@ namespace strategy_complete_ways {
         const std::size_t file_size = osmium::util::file_size(input_file.filename());
         osmium::ProgressBar progress_bar{file_size * 2, display_progress};
 
+        // With the spool option the ways and relations are only read once
+        // from the input file, the second pass gets them from the spool.
+        std::unique_ptr<SpillFile> spool;
+        if (m_spool) {
+            spool.reset(new SpillFile{});
+        }
+
         vout << "First pass...\n";
         Pass1 pass1{*this};
-        pass1.run(progress_bar, input_file, osmium::io::read_meta::no);
+        if (spool) {
+            pass1.spool_to(*spool);
+            pass1.run(progress_bar, input_file);
+        } else {
+            pass1.run(progress_bar, input_file, osmium::io::read_meta::no);
+        }
         progress_bar.file_done(file_size);
 
+        if (spool) {
+            vout << "Spooled " << (spool->size() / (1024 * 1024)) << " MBytes of ways and relations.\n";
+        }
+
         // recursively get parents of all relations that are in an extract
         const auto relations_map = pass1.relations_map_stash().build_member_to_parent_index();
         for (auto& e : m_extracts) {
@@ -172,7 +211,11 @@ namespace strategy_complete_ways {
         progress_bar.remove();
         vout << "Second pass...\n";
         Pass2 pass2{*this};
-        pass2.run(progress_bar, input_file);
+        if (spool) {
+            pass2.run_with_spool(progress_bar, *spool, input_file);
+        } else {
+            pass2.run(progress_bar, input_file);
+        }
 
         progress_bar.done();
     }
@@ -26,18 +26,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <memory>
 #include <vector>
 
-#include <osmium/index/id_set.hpp>
 #include <osmium/index/relations_map.hpp>
 
+#include "id_set.hpp"
 #include "strategy.hpp"
 
 namespace strategy_complete_ways {
 
     struct Data {
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> extra_node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> way_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> relation_ids;
+        IdSetAdaptive node_ids;
+        IdSetAdaptive extra_node_ids;
+        IdSetAdaptive way_ids;
+        IdSetAdaptive relation_ids;
+
+        explicit Data(bool dense_id_sets);
 
         void add_relation_parents(osmium::unsigned_object_id_type id, const osmium::index::RelationsMapIndex& map);
     };
@@ -50,12 +52,17 @@ namespace strategy_complete_ways {
         using extract_data = ExtractData<Data>;
         std::vector<extract_data> m_extracts;
 
+        bool m_spool = false;
+        bool m_dense_id_sets = false;
+
     public:
 
-        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& /*options*/);
+        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options);
 
         const char* name() const noexcept override final;
 
+        void show_arguments(osmium::util::VerboseOutput& vout) override final;
+
         void run(osmium::util::VerboseOutput& vout, bool display_progress, const osmium::io::File& input_file) override final;
 
     }; // class Strategy
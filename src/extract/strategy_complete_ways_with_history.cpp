@@ -20,13 +20,47 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
+#include <cstddef>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "id_pair_sorter.hpp"
 #include "strategy_complete_ways_with_history.hpp"
+#include "../exception.hpp"
+#include "../util.hpp"
 
 namespace strategy_complete_ways_with_history {
 
+    enum : std::size_t {
+        // Memory used for sorting the extra nodes with "-S spill" if no
+        // size is given, in MBytes.
+        default_spill_memory = 256
+    };
+
+    Data::Data(bool dense_id_sets) :
+        node_ids(dense_id_sets),
+        extra_node_ids(dense_id_sets),
+        way_ids(dense_id_sets),
+        relation_ids(dense_id_sets) {
+    }
+
+    void Data::add_to_extra_node_queue(osmium::unsigned_object_id_type id) {
+        if (extra_node_queue_pos * 2 >= extra_node_queue.size()) {
+            extra_node_queue.erase(extra_node_queue.begin(), extra_node_queue.begin() + extra_node_queue_pos);
+            extra_node_queue_pos = 0;
+        }
+        extra_node_queue.push_back(id);
+    }
+
+    bool Data::in_extra_node_queue(osmium::unsigned_object_id_type id) {
+        while (extra_node_queue_pos < extra_node_queue.size() && extra_node_queue[extra_node_queue_pos] < id) {
+            ++extra_node_queue_pos;
+        }
+        return extra_node_queue_pos < extra_node_queue.size() && extra_node_queue[extra_node_queue_pos] == id;
+    }
+
     void Data::add_relation_parents(osmium::unsigned_object_id_type id, const osmium::index::RelationsMapIndex& map) {
         map.for_each_parent(id, [&](osmium::unsigned_object_id_type parent_id) {
             if (! relation_ids.get(parent_id)) {
@@ -36,11 +70,34 @@ namespace strategy_complete_ways_with_history {
         });
     }
 
-    Strategy::Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& /*options*/) :
-        ExtractStrategy() {
+    // Returns the memory in bytes for the "spill" option, 0 if not set.
+    static std::size_t spill_memory(const osmium::util::Options& options) {
+        const std::string value{options.get("spill", "false")};
+        if (value == "false" || value == "no") {
+            return 0;
+        }
+        if (value == "true" || value == "yes") {
+            return default_spill_memory * 1024 * 1024;
+        }
+        if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != std::string::npos || std::stoul(value) == 0) {
+            throw argument_error{"Value for strategy option 'spill' must be 'true' or the memory to use in MBytes (at least 1)."};
+        }
+        return std::stoul(value) * 1024 * 1024;
+    }
+
+    Strategy::Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options) :
+        ExtractStrategy(),
+        m_spill_memory(spill_memory(options)),
+        m_dense_id_sets(dense_id_sets(options)) {
         m_extracts.reserve(extracts.size());
         for (const auto& extract : extracts) {
-            m_extracts.emplace_back(*extract);
+            m_extracts.emplace_back(*extract, m_dense_id_sets);
+        }
+
+        for (const auto& option : options) {
+            if (std::string{"spill"} != option.first && std::string{"id-sets"} != option.first) {
+                warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'complete_ways' strategy.\n");
+            }
         }
     }
 
@@ -48,52 +105,77 @@ namespace strategy_complete_ways_with_history {
         return "complete_ways";
     }
 
+    void Strategy::show_arguments(osmium::util::VerboseOutput& vout) {
+        vout << "Additional strategy options:\n";
+        if (m_spill_memory > 0) {
+            vout << "  spill: " << (m_spill_memory / (1024 * 1024)) << " MBytes\n";
+        } else {
+            vout << "  spill: no\n";
+        }
+        vout << "  id-sets: " << (m_dense_id_sets ? "dense" : "adaptive") << '\n';
+        vout << '\n';
+    }
+
     class Pass1 : public Pass<Strategy, Pass1> {
 
         osmium::index::RelationsMapStash m_relations_map_stash;
-        std::vector<osmium::unsigned_object_id_type> m_current_way_nodes;
-        osmium::unsigned_object_id_type m_current_way_id = 0;
+        IdPairSorter* m_sorter;
+
+        void add_extra_node(extract_data& e, osmium::unsigned_object_id_type id) const {
+            if (m_sorter) {
+                e.spilled_node_ids.push_back(id);
+            } else {
+                e.extra_node_ids.set(id);
+            }
+        }
 
     public:
 
-        Pass1(Strategy& strategy) :
-            Pass(strategy) {
-        }
+        static constexpr const bool dispatch_nodes_by_location = true;
 
-        void add_extra_nodes() {
-            for (auto& e : extracts()) {
-                if (e.way_ids.get(m_current_way_id)) {
-                    for (const auto& id : m_current_way_nodes) {
-                        e.extra_node_ids.set(id);
-                    }
-                }
-            }
-            m_current_way_nodes.clear();
+        // If sorter is set, the extra nodes are added to it together with
+        // the index of the extract instead of to the extra_node_ids.
+        Pass1(Strategy& strategy, IdPairSorter* sorter) :
+            Pass(strategy),
+            m_sorter(sorter) {
         }
 
+        // only called for nodes inside the extract
         void enode(extract_data& e, const osmium::Node& node) {
-            if (e.contains(node.location())) {
-                e.node_ids.set(node.positive_id());
-            }
+            e.node_ids.set(node.positive_id());
         }
 
-        void way(const osmium::Way& way) {
-            if (m_current_way_id != way.positive_id()) {
-                add_extra_nodes();
-                m_current_way_id = way.id();
+        // If any version of a way is in the extract, the nodes of all
+        // versions of this way are needed. Until a version is found that
+        // is in the extract, the nodes of the earlier versions are kept
+        // in current_way_nodes.
+        void eway(extract_data& e, const osmium::Way& way) {
+            if (e.current_way_id != way.positive_id()) {
+                e.current_way_id = way.positive_id();
+                e.current_way_nodes.clear();
             }
 
-            for (const auto& wn : way.nodes()) {
-                m_current_way_nodes.push_back(wn.positive_ref());
+            if (!e.way_ids.get(way.positive_id())) {
+                const auto& nodes = way.nodes();
+                const bool in_extract = std::any_of(nodes.cbegin(), nodes.cend(), [&e](const osmium::NodeRef& nr) {
+                    return e.node_ids.get(nr.positive_ref());
+                });
+                if (!in_extract) {
+                    for (const auto& nr : nodes) {
+                        e.current_way_nodes.push_back(nr.positive_ref());
+                    }
+                    return;
+                }
+
+                e.way_ids.set(way.positive_id());
+                for (const auto id : e.current_way_nodes) {
+                    add_extra_node(e, id);
+                }
+                e.current_way_nodes.clear();
             }
-        }
 
-        void eway(extract_data& e, const osmium::Way& way) {
             for (const auto& nr : way.nodes()) {
-                if (e.node_ids.get(nr.positive_ref())) {
-                    e.way_ids.set(way.positive_id());
-                    return;
-                }
+                add_extra_node(e, nr.positive_ref());
             }
         }
 
@@ -122,6 +204,19 @@ namespace strategy_complete_ways_with_history {
             }
         }
 
+        void buffer_done() {
+            if (!m_sorter) {
+                return;
+            }
+            for (std::size_t n = 0; n < extracts().size(); ++n) {
+                auto& ids = extracts()[n].spilled_node_ids;
+                for (const auto id : ids) {
+                    m_sorter->add(id, n);
+                }
+                ids.clear();
+            }
+        }
+
         osmium::index::RelationsMapStash& relations_map_stash() noexcept {
             return m_relations_map_stash;
         }
@@ -130,15 +225,40 @@ namespace strategy_complete_ways_with_history {
 
     class Pass2 : public Pass<Strategy, Pass2> {
 
+        IdPairSorter* m_sorter;
+        osmium::unsigned_object_id_type m_current_node_id = 0;
+
     public:
 
-        Pass2(Strategy& strategy) :
-            Pass(strategy) {
+        // If sorter is set, the extra nodes are taken from it. This is a
+        // merge join of the sorted extra nodes with the nodes in the
+        // input, so the input must be sorted.
+        Pass2(Strategy& strategy, IdPairSorter* sorter) :
+            Pass(strategy),
+            m_sorter(sorter) {
+        }
+
+        // All versions of a node follow each other, so the extracts needing
+        // the node are only looked up for its first version.
+        void node(const osmium::Node& node) {
+            if (!m_sorter || node.positive_id() == m_current_node_id) {
+                return;
+            }
+            m_current_node_id = node.positive_id();
+
+            while (!m_sorter->empty() && m_sorter->get().id < m_current_node_id) {
+                m_sorter->next();
+            }
+            while (!m_sorter->empty() && m_sorter->get().id == m_current_node_id) {
+                extracts()[m_sorter->get().index].add_to_extra_node_queue(m_current_node_id);
+                m_sorter->next();
+            }
         }
 
         void enode(extract_data& e, const osmium::Node& node) {
             if (e.node_ids.get(node.positive_id()) ||
-                e.extra_node_ids.get(node.positive_id())) {
+                e.extra_node_ids.get(node.positive_id()) ||
+                e.in_extra_node_queue(node.positive_id())) {
                 e.write(node);
             }
         }
@@ -162,11 +282,26 @@ namespace strategy_complete_ways_with_history {
         const std::size_t file_size = osmium::util::file_size(input_file.filename());
         osmium::ProgressBar progress_bar{file_size * 2, display_progress};
 
+        std::unique_ptr<IdPairSorter> sorter;
+        if (m_spill_memory > 0) {
+            sorter.reset(new IdPairSorter{m_spill_memory});
+        }
+
         vout << "First pass...\n";
-        Pass1 pass1{*this};
+        Pass1 pass1{*this, sorter.get()};
         pass1.run(progress_bar, input_file, osmium::io::read_meta::no);
         progress_bar.file_done(file_size);
-        pass1.add_extra_nodes();
+
+        if (sorter) {
+            sorter->done();
+            progress_bar.remove();
+            if (sorter->num_runs() == 0) {
+                vout << "Way node references fit into memory, no temporary files needed.\n";
+            } else {
+                vout << "Wrote " << (sorter->bytes_written() / (1024 * 1024)) << " MBytes of way node references in "
+                     << sorter->num_runs() << " sorted runs to temporary files.\n";
+            }
+        }
 
         // recursively get parents of all relations that are in an extract
         const auto relations_map = pass1.relations_map_stash().build_member_to_parent_index();
@@ -178,7 +313,7 @@ namespace strategy_complete_ways_with_history {
 
         progress_bar.remove();
         vout << "Second pass...\n";
-        Pass2 pass2{*this};
+        Pass2 pass2{*this, sorter.get()};
         pass2.run(progress_bar, input_file);
         progress_bar.done();
     }
@@ -23,21 +23,47 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
 #include <memory>
 #include <vector>
 
-#include <osmium/index/id_set.hpp>
 #include <osmium/index/relations_map.hpp>
 
+#include "id_set.hpp"
 #include "strategy.hpp"
 
 namespace strategy_complete_ways_with_history {
 
     struct Data {
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> extra_node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> way_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> relation_ids;
+        IdSetAdaptive node_ids;
+        IdSetAdaptive extra_node_ids;
+        IdSetAdaptive way_ids;
+        IdSetAdaptive relation_ids;
+
+        // The way whose versions are currently read in the first pass and
+        // the nodes of those versions as long as it is not known whether
+        // the way is in the extract.
+        osmium::unsigned_object_id_type current_way_id = 0;
+        std::vector<osmium::unsigned_object_id_type> current_way_nodes;
+
+        // With the spill option the extra nodes found in the first pass
+        // for the current buffer. They are moved to the sorter after each
+        // buffer.
+        std::vector<osmium::unsigned_object_id_type> spilled_node_ids;
+
+        // With the spill option the extra nodes of the current buffer in
+        // the second pass, taken from the sorter in ID order. The IDs
+        // before extra_node_queue_pos have already been handled.
+        std::vector<osmium::unsigned_object_id_type> extra_node_queue;
+        std::size_t extra_node_queue_pos = 0;
+
+        explicit Data(bool dense_id_sets);
+
+        void add_to_extra_node_queue(osmium::unsigned_object_id_type id);
+
+        // Is this an extra node from the queue? Skips all smaller IDs in
+        // the queue, so IDs must be asked for in order.
+        bool in_extra_node_queue(osmium::unsigned_object_id_type id);
 
         void add_relation_parents(osmium::unsigned_object_id_type id, const osmium::index::RelationsMapIndex& map);
     };
@@ -50,12 +76,19 @@ namespace strategy_complete_ways_with_history {
         using extract_data = ExtractData<Data>;
         std::vector<extract_data> m_extracts;
 
+        // Memory used for sorting the extra nodes with the spill option
+        // or 0 if they are kept in ID sets.
+        std::size_t m_spill_memory = 0;
+        bool m_dense_id_sets = false;
+
     public:
 
-        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& /*options*/);
+        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options);
 
         const char* name() const noexcept override final;
 
+        void show_arguments(osmium::util::VerboseOutput& vout) override final;
+
         void run(osmium::util::VerboseOutput& vout, bool display_progress, const osmium::io::File& input_file) override final;
 
     }; // class Strategy
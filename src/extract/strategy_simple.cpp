@@ -20,22 +20,39 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <osmium/handler/check_order.hpp>
+#include <osmium/io/file_format.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
 
 #include "strategy_simple.hpp"
+#include "../pbf_blocks.hpp"
 #include "../util.hpp"
 
 namespace strategy_simple {
 
+    Data::Data(bool dense_id_sets) :
+        node_ids(dense_id_sets),
+        way_ids(dense_id_sets) {
+    }
+
     Strategy::Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options) :
-        ExtractStrategy() {
+        ExtractStrategy(),
+        m_dense_id_sets(dense_id_sets(options)) {
         m_extracts.reserve(extracts.size());
         for (const auto& extract : extracts) {
-            m_extracts.emplace_back(*extract);
+            m_extracts.emplace_back(*extract, m_dense_id_sets);
         }
 
         for (const auto& option : options) {
-            warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'simple' strategy.\n");
+            if (std::string{"id-sets"} != option.first) {
+                warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'simple' strategy.\n");
+            }
         }
     }
 
@@ -43,12 +60,138 @@ namespace strategy_simple {
         return "simple";
     }
 
+    // Blocks of a PBF file can be skipped without decoding if their nodes
+    // are outside all extracts. Finding that out needs the blocks to be
+    // decompressed, so the other blocks are decompressed twice. This only
+    // pays off if the extracts together cover not much of the world.
+    bool Strategy::use_block_skipping(const osmium::io::File& input_file) const {
+        if (input_file.format() != osmium::io::file_format::pbf) {
+            return false;
+        }
+
+        double area = 0.0;
+        for (const auto& e : m_extracts) {
+            const auto& box = e.envelope();
+            if (!box.valid()) {
+                continue;
+            }
+            area += (box.top_right().lon() - box.bottom_left().lon()) *
+                    (box.top_right().lat() - box.bottom_left().lat());
+        }
+
+        return area < 360.0 * 180.0 / 4;
+    }
+
+    void Strategy::show_arguments(osmium::util::VerboseOutput& vout) {
+        vout << "Additional strategy options:\n";
+        vout << "  id-sets: " << (m_dense_id_sets ? "dense" : "adaptive") << '\n';
+        vout << '\n';
+    }
+
+    /**
+     * Reads a PBF file and skips all blocks that only contain nodes
+     * outside the envelopes of all extracts without decoding them. The
+     * other blocks are decoded in batches. Can be used with
+     * Pass::run_reader().
+     */
+    class BlockSkippingReader {
+
+        PBFBlockReader m_reader;
+        std::vector<osmium::Box> m_envelopes;
+        std::vector<osmium::memory::Buffer> m_buffers;
+        std::size_t m_next_buffer = 0;
+        std::size_t m_blocks = 0;
+        std::size_t m_skipped_blocks = 0;
+        bool m_eof = false;
+
+        enum : std::size_t {
+            blocks_per_batch = 64
+        };
+
+        static bool overlaps(const osmium::Box& a, const osmium::Box& b) noexcept {
+            return a.bottom_left().x() <= b.top_right().x() &&
+                   b.bottom_left().x() <= a.top_right().x() &&
+                   a.bottom_left().y() <= b.top_right().y() &&
+                   b.bottom_left().y() <= a.top_right().y();
+        }
+
+        bool can_skip(const PBFBlock& block) const noexcept {
+            if (!block.has_objects()) {
+                return true;
+            }
+            if (!block.only_nodes() || !block.node_envelope().valid()) {
+                return false;
+            }
+            for (const auto& envelope : m_envelopes) {
+                if (overlaps(block.node_envelope(), envelope)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void read_batch() {
+            std::vector<PBFBlock> blocks;
+            while (blocks.size() < blocks_per_batch) {
+                PBFBlock block;
+                if (!m_reader.read(block)) {
+                    m_eof = true;
+                    break;
+                }
+                ++m_blocks;
+                if (can_skip(block)) {
+                    ++m_skipped_blocks;
+                } else {
+                    blocks.push_back(std::move(block));
+                }
+            }
+
+            m_buffers.clear();
+            m_next_buffer = 0;
+            if (!blocks.empty()) {
+                m_buffers = decode_pbf_blocks(m_reader.header_block(), blocks);
+            }
+        }
+
+    public:
+
+        BlockSkippingReader(const std::string& filename, std::vector<osmium::Box>&& envelopes) :
+            m_reader(filename, true),
+            m_envelopes(std::move(envelopes)) {
+        }
+
+        osmium::memory::Buffer read() {
+            while (m_next_buffer == m_buffers.size()) {
+                if (m_eof) {
+                    return osmium::memory::Buffer{};
+                }
+                read_batch();
+            }
+            return std::move(m_buffers[m_next_buffer++]);
+        }
+
+        std::size_t offset() const noexcept {
+            return m_reader.offset();
+        }
+
+        std::size_t blocks() const noexcept {
+            return m_blocks;
+        }
+
+        std::size_t skipped_blocks() const noexcept {
+            return m_skipped_blocks;
+        }
+
+    }; // class BlockSkippingReader
+
     class Pass1 : public Pass<Strategy, Pass1> {
 
         osmium::handler::CheckOrder m_check_order;
 
     public:
 
+        static constexpr const bool dispatch_nodes_by_location = true;
+
         Pass1(Strategy& strategy) :
             Pass(strategy) {
         }
@@ -57,11 +200,10 @@ namespace strategy_simple {
             m_check_order.node(node);
         }
 
+        // only called for nodes inside the extract
         void enode(extract_data& e, const osmium::Node& node) {
-            if (e.contains(node.location())) {
-                e.write(node);
-                e.node_ids.set(node.positive_id());
-            }
+            e.write(node);
+            e.node_ids.set(node.positive_id());
         }
 
         void way(const osmium::Way& way) {
@@ -109,9 +251,22 @@ namespace strategy_simple {
         osmium::ProgressBar progress_bar{file_size, display_progress};
 
         Pass1 pass1{*this};
-        pass1.run(progress_bar, input_file);
-
-        progress_bar.done();
+        if (use_block_skipping(input_file)) {
+            std::vector<osmium::Box> envelopes;
+            for (const auto& e : m_extracts) {
+                if (e.envelope().valid()) {
+                    envelopes.push_back(e.envelope());
+                }
+            }
+            BlockSkippingReader reader{input_file.filename(), std::move(envelopes)};
+            pass1.run_reader(progress_bar, reader);
+            progress_bar.done();
+            vout << "Skipped " << reader.skipped_blocks() << " of " << reader.blocks()
+                 << " PBF blocks without nodes in any extract.\n";
+        } else {
+            pass1.run(progress_bar, input_file);
+            progress_bar.done();
+        }
     }
 
 } // namespace strategy_simple
@@ -26,15 +26,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <memory>
 #include <vector>
 
-#include <osmium/index/id_set.hpp>
-
+#include "id_set.hpp"
 #include "strategy.hpp"
 
 namespace strategy_simple {
 
     struct Data {
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> way_ids;
+        IdSetAdaptive node_ids;
+        IdSetAdaptive way_ids;
+
+        explicit Data(bool dense_id_sets);
     };
 
     class Strategy : public ExtractStrategy {
@@ -45,12 +46,18 @@ namespace strategy_simple {
         using extract_data = ExtractData<Data>;
         std::vector<extract_data> m_extracts;
 
+        bool m_dense_id_sets = false;
+
+        bool use_block_skipping(const osmium::io::File& input_file) const;
+
     public:
 
-        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& /*options*/);
+        explicit Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options);
 
         const char* name() const noexcept override final;
 
+        void show_arguments(osmium::util::VerboseOutput& vout) override final;
+
         void run(osmium::util::VerboseOutput& vout, bool display_progress, const osmium::io::File& input_file) override final;
 
     }; // class Strategy
@@ -20,14 +20,26 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <memory>
+
 #include <osmium/handler/check_order.hpp>
 #include <osmium/util/string.hpp>
 
 #include "strategy_smart.hpp"
+#include "../spill_file.hpp"
 #include "../util.hpp"
 
 namespace strategy_smart {
 
+    Data::Data(bool dense_id_sets) :
+        node_ids(dense_id_sets),
+        extra_node_ids(dense_id_sets),
+        way_ids(dense_id_sets),
+        extra_way_ids(dense_id_sets),
+        relation_ids(dense_id_sets),
+        extra_relation_ids(dense_id_sets) {
+    }
+
     void Data::add_relation(const osmium::Relation& relation) {
         for (const auto& member : relation.members()) {
             const auto ref = member.positive_ref();
@@ -56,18 +68,21 @@ namespace strategy_smart {
 
     Strategy::Strategy(const std::vector<std::unique_ptr<Extract>>& extracts, const osmium::util::Options& options) :
         ExtractStrategy(),
-        m_types() {
+        m_types(),
+        m_dense_id_sets(dense_id_sets(options)) {
         m_extracts.reserve(extracts.size());
         for (const auto& extract : extracts) {
-            m_extracts.emplace_back(*extract);
+            m_extracts.emplace_back(*extract, m_dense_id_sets);
         }
 
         for (const auto& option : options) {
-            if (std::string{"types"} != option.first) {
+            if (std::string{"types"} != option.first && std::string{"spool"} != option.first && std::string{"id-sets"} != option.first) {
                 warning(std::string{"Ignoring unknown option '"} + option.first + "' for 'smart' strategy.\n");
             }
         }
 
+        m_spool = options.is_true("spool");
+
         const auto types = options.get("types");
         if (types == "") {
             m_types = {"multipolygon"};
@@ -103,6 +118,8 @@ namespace strategy_smart {
                 vout << "      " << type << '\n';
             }
         }
+        vout << "  spool: " << yes_no(m_spool);
+        vout << "  id-sets: " << (m_dense_id_sets ? "dense" : "adaptive") << '\n';
         vout << '\n';
     }
 
@@ -113,6 +130,8 @@ namespace strategy_smart {
 
     public:
 
+        static constexpr const bool dispatch_nodes_by_location = true;
+
         Pass1(Strategy& strategy) :
             Pass(strategy) {
         }
@@ -121,10 +140,9 @@ namespace strategy_smart {
             m_check_order.node(node);
         }
 
+        // only called for nodes inside the extract
         void enode(extract_data& e, const osmium::Node& node) {
-            if (e.contains(node.location())) {
-                e.node_ids.set(node.positive_id());
-            }
+            e.node_ids.set(node.positive_id());
         }
 
         void way(const osmium::Way& way) {
@@ -233,11 +251,27 @@ namespace strategy_smart {
         const std::size_t file_size = osmium::util::file_size(input_file.filename());
         osmium::ProgressBar progress_bar{file_size * 3, display_progress};
 
+        // With the spool option the ways and relations are only read once
+        // from the input file, the later passes get them from the spool.
+        std::unique_ptr<SpillFile> spool;
+        if (m_spool) {
+            spool.reset(new SpillFile{});
+        }
+
         vout << "First pass...\n";
         Pass1 pass1{*this};
-        pass1.run(progress_bar, input_file, osmium::io::read_meta::no);
+        if (spool) {
+            pass1.spool_to(*spool);
+            pass1.run(progress_bar, input_file);
+        } else {
+            pass1.run(progress_bar, input_file, osmium::io::read_meta::no);
+        }
         progress_bar.file_done(file_size);
 
+        if (spool) {
+            vout << "Spooled " << (spool->size() / (1024 * 1024)) << " MBytes of ways and relations.\n";
+        }
+
         // recursively get parents of all relations that are in an extract
         const auto relations_map = pass1.relations_map_stash().build_member_to_parent_index();
         for (auto& e : m_extracts) {
@@ -249,13 +283,21 @@ namespace strategy_smart {
         progress_bar.remove();
         vout << "Second pass...\n";
         Pass2 pass2{*this};
-        pass2.run(progress_bar, input_file, osmium::osm_entity_bits::way, osmium::io::read_meta::no);
+        if (spool) {
+            pass2.run_spool(*spool);
+        } else {
+            pass2.run(progress_bar, input_file, osmium::osm_entity_bits::way, osmium::io::read_meta::no);
+        }
         progress_bar.file_done(file_size);
 
         progress_bar.remove();
         vout << "Third pass...\n";
         Pass3 pass3{*this};
-        pass3.run(progress_bar, input_file);
+        if (spool) {
+            pass3.run_with_spool(progress_bar, *spool, input_file);
+        } else {
+            pass3.run(progress_bar, input_file);
+        }
 
         progress_bar.done();
     }
@@ -27,20 +27,22 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string>
 #include <vector>
 
-#include <osmium/index/id_set.hpp>
 #include <osmium/index/relations_map.hpp>
 
+#include "id_set.hpp"
 #include "strategy.hpp"
 
 namespace strategy_smart {
 
     struct Data {
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> extra_node_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> way_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> extra_way_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> relation_ids;
-        osmium::index::IdSetDense<osmium::unsigned_object_id_type> extra_relation_ids;
+        IdSetAdaptive node_ids;
+        IdSetAdaptive extra_node_ids;
+        IdSetAdaptive way_ids;
+        IdSetAdaptive extra_way_ids;
+        IdSetAdaptive relation_ids;
+        IdSetAdaptive extra_relation_ids;
+
+        explicit Data(bool dense_id_sets);
 
         void add_relation(const osmium::Relation& relation);
         void add_relation_parents(osmium::unsigned_object_id_type id, const osmium::index::RelationsMapIndex& map);
@@ -56,6 +58,9 @@ namespace strategy_smart {
 
         std::vector<std::string> m_types;
 
+        bool m_spool = false;
+        bool m_dense_id_sets = false;
+
         bool check_type(const osmium::Relation& relation) const noexcept;
 
     public:
@@ -0,0 +1,179 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <utility>
+
+#include <osmium/io/writer.hpp>
+
+#include "writer_threads.hpp"
+
+WriterThreads::WriterThreads(unsigned int num_threads, std::size_t max_queue_size) :
+    m_max_queue_size(max_queue_size) {
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        m_queues.emplace_back(new Queue{});
+    }
+    for (auto& queue : m_queues) {
+        Queue& q = *queue;
+        m_threads.emplace_back([this, &q]() {
+            work(q);
+        });
+    }
+}
+
+WriterThreads::~WriterThreads() noexcept {
+    // If finish() wasn't called, something went wrong, so the buffers
+    // still in the queues are not written.
+    for (auto& queue : m_queues) {
+        std::lock_guard<std::mutex> lock{queue->mutex};
+        queue->tasks.clear();
+    }
+    stop();
+}
+
+void WriterThreads::work(Queue& queue) {
+    while (true) {
+        Task task{nullptr, osmium::memory::Buffer{}, false};
+        {
+            std::unique_lock<std::mutex> lock{queue.mutex};
+            queue.not_empty.wait(lock, [&queue]() {
+                return queue.done || !queue.tasks.empty();
+            });
+            if (queue.tasks.empty()) {
+                return;
+            }
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            if (queue.error) {
+                // after an error further tasks are dropped
+                queue.not_full.notify_all();
+                continue;
+            }
+        }
+        queue.not_full.notify_all();
+
+        try {
+            if (task.close) {
+                task.writer->close();
+            } else {
+                (*task.writer)(std::move(task.buffer));
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{queue.mutex};
+            queue.error = std::current_exception();
+        }
+    }
+}
+
+void WriterThreads::push(std::size_t queue, Task&& task) {
+    Queue& q = *m_queues[queue];
+    std::unique_lock<std::mutex> lock{q.mutex};
+    if (q.error) {
+        std::rethrow_exception(q.error);
+    }
+    if (q.tasks.size() >= m_max_queue_size) {
+        const auto start = std::chrono::steady_clock::now();
+        q.not_full.wait(lock, [this, &q]() {
+            return q.tasks.size() < m_max_queue_size;
+        });
+        q.stall_time += std::chrono::steady_clock::now() - start;
+    }
+    if (!task.close) {
+        ++q.buffers;
+    }
+    q.tasks.push_back(std::move(task));
+    if (q.tasks.size() > q.max_depth) {
+        q.max_depth = q.tasks.size();
+    }
+    lock.unlock();
+    q.not_empty.notify_one();
+}
+
+std::size_t WriterThreads::assign() noexcept {
+    const auto queue = m_next_queue;
+    m_next_queue = (m_next_queue + 1) % m_queues.size();
+    return queue;
+}
+
+void WriterThreads::add(std::size_t queue, osmium::io::Writer& writer, osmium::memory::Buffer&& buffer) {
+    push(queue, Task{&writer, std::move(buffer), false});
+}
+
+void WriterThreads::close(std::size_t queue, osmium::io::Writer& writer) {
+    push(queue, Task{&writer, osmium::memory::Buffer{}, true});
+}
+
+void WriterThreads::stop() noexcept {
+    for (auto& queue : m_queues) {
+        {
+            std::lock_guard<std::mutex> lock{queue->mutex};
+            queue->done = true;
+        }
+        queue->not_empty.notify_one();
+    }
+    for (auto& thread : m_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void WriterThreads::finish() {
+    stop();
+    for (auto& queue : m_queues) {
+        if (queue->error) {
+            std::rethrow_exception(queue->error);
+        }
+    }
+}
+
+std::size_t WriterThreads::buffers_written() const noexcept {
+    std::size_t sum = 0;
+    for (const auto& queue : m_queues) {
+        sum += queue->buffers;
+    }
+    return sum;
+}
+
+std::size_t WriterThreads::max_queue_depth() const noexcept {
+    std::size_t depth = 0;
+    for (const auto& queue : m_queues) {
+        depth = std::max(depth, queue->max_depth);
+    }
+    return depth;
+}
+
+double WriterThreads::stall_seconds() const noexcept {
+    std::chrono::steady_clock::duration time{0};
+    for (const auto& queue : m_queues) {
+        time += queue->stall_time;
+    }
+    return std::chrono::duration<double>(time).count();
+}
+
@@ -0,0 +1,130 @@
+#ifndef EXTRACT_WRITER_THREADS_HPP
+#define EXTRACT_WRITER_THREADS_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+
+namespace osmium {
+    namespace io {
+        class Writer;
+    }
+}
+
+/**
+ * A number of threads writing buffers to the writers of the extracts, so
+ * that reading the input and working on the extracts doesn't have to
+ * wait for slow outputs.
+ *
+ * Each writer is assigned to one thread (see assign()), so buffers for
+ * a writer are written in the order they were added. Each thread has a
+ * queue of at most max_queue_size buffers. If it is full, add() blocks
+ * until there is space again. The time spent waiting is counted and can
+ * be shown together with other statistics after finish().
+ *
+ * If writing fails, the exception is re-thrown from the next call to
+ * add(), close(), or finish().
+ */
+class WriterThreads {
+
+    struct Task {
+        osmium::io::Writer* writer;
+        osmium::memory::Buffer buffer;
+        bool close;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<Task> tasks;
+        std::exception_ptr error;
+        std::chrono::steady_clock::duration stall_time{0};
+        std::size_t max_depth = 0;
+        std::size_t buffers = 0;
+        bool done = false;
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::size_t m_max_queue_size;
+    std::size_t m_next_queue = 0;
+
+    void push(std::size_t queue, Task&& task);
+
+    void work(Queue& queue);
+
+    void stop() noexcept;
+
+public:
+
+    enum : std::size_t {
+        default_max_queue_size = 32
+    };
+
+    WriterThreads(unsigned int num_threads, std::size_t max_queue_size = default_max_queue_size);
+
+    WriterThreads(const WriterThreads&) = delete;
+    WriterThreads& operator=(const WriterThreads&) = delete;
+
+    WriterThreads(WriterThreads&&) = delete;
+    WriterThreads& operator=(WriterThreads&&) = delete;
+
+    ~WriterThreads() noexcept;
+
+    /// Return the queue to use for the next writer (round robin).
+    std::size_t assign() noexcept;
+
+    /// Add a buffer to be written by the writer to the queue.
+    void add(std::size_t queue, osmium::io::Writer& writer, osmium::memory::Buffer&& buffer);
+
+    /// Close the writer after all buffers added before have been written.
+    void close(std::size_t queue, osmium::io::Writer& writer);
+
+    /// Wait until all queues are empty and stop the threads.
+    void finish();
+
+    // The statistics are only complete after finish() was called.
+
+    /// The number of buffers written.
+    std::size_t buffers_written() const noexcept;
+
+    /// The largest number of buffers in any queue at the same time.
+    std::size_t max_queue_depth() const noexcept;
+
+    /// The time add() had to wait for space in a queue in seconds.
+    double stall_seconds() const noexcept;
+
+}; // class WriterThreads
+
+#endif // EXTRACT_WRITER_THREADS_HPP
@@ -0,0 +1,136 @@
+#ifndef LOSER_TREE_HPP
+#define LOSER_TREE_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * Merges several sorted sources into one sorted stream using a
+ * tournament tree of losers.
+ *
+ * Each source must have the member functions empty(), get() (returning
+ * the current element), and next() (advancing to the next element). The
+ * sources are not copied, so the vector must not be changed while the
+ * tree is in use.
+ *
+ * The leaves of the tree are the sources, each inner node stores the
+ * index of the source that lost the comparison at that node, the overall
+ * winner is kept separately. After advancing the winning source only the
+ * path from its leaf to the root has to be replayed, which needs exactly
+ * one comparison per level. Of several equal elements the one from the
+ * source with the lowest index is returned first.
+ */
+template <typename TSource, typename TCompare>
+class LoserTree {
+
+    std::vector<TSource>& m_sources;
+    TCompare m_compare;
+
+    // m_tree[0] is the winner, m_tree[1] to m_tree[size - 1] are the
+    // inner nodes. Leaves (size to 2 * size - 1) are not stored.
+    std::vector<std::size_t> m_tree;
+
+    // Does source a come before source b? Empty sources lose against
+    // all others.
+    bool beats(std::size_t a, std::size_t b) const {
+        const auto& sa = m_sources[a];
+        const auto& sb = m_sources[b];
+        if (sa.empty() || sb.empty()) {
+            if (sa.empty() && sb.empty()) {
+                return a < b;
+            }
+            return sb.empty();
+        }
+        if (m_compare(sa.get(), sb.get())) {
+            return true;
+        }
+        if (m_compare(sb.get(), sa.get())) {
+            return false;
+        }
+        return a < b;
+    }
+
+    std::size_t build(std::size_t node) {
+        const std::size_t size = m_sources.size();
+        if (node >= size) {
+            return node - size;
+        }
+        const auto left = build(2 * node);
+        const auto right = build(2 * node + 1);
+        if (beats(left, right)) {
+            m_tree[node] = right;
+            return left;
+        }
+        m_tree[node] = left;
+        return right;
+    }
+
+    void replay() {
+        const std::size_t size = m_sources.size();
+        std::size_t winner = m_tree[0];
+        for (std::size_t node = (winner + size) / 2; node > 0; node /= 2) {
+            if (beats(m_tree[node], winner)) {
+                std::swap(m_tree[node], winner);
+            }
+        }
+        m_tree[0] = winner;
+    }
+
+public:
+
+    explicit LoserTree(std::vector<TSource>& sources, TCompare compare = TCompare{}) :
+        m_sources(sources),
+        m_compare(std::move(compare)),
+        m_tree(sources.size(), 0) {
+        if (sources.size() > 1) {
+            m_tree[0] = build(1);
+        }
+    }
+
+    bool empty() const noexcept {
+        return m_sources.empty() || m_sources[m_tree[0]].empty();
+    }
+
+    // The smallest current element of all sources. Only call this if
+    // the tree is not empty.
+    auto get() const -> decltype(m_sources[0].get()) {
+        return m_sources[m_tree[0]].get();
+    }
+
+    // Index of the source the current element comes from.
+    std::size_t source_index() const noexcept {
+        return m_tree[0];
+    }
+
+    // Go to the next element.
+    void next() {
+        m_sources[m_tree[0]].next();
+        replay();
+    }
+
+}; // class LoserTree
+
+#endif // LOSER_TREE_HPP
@@ -0,0 +1,151 @@
+#ifndef PARALLEL_SORT_HPP
+#define PARALLEL_SORT_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace detail {
+
+    // Below this number of elements sorting is done in the calling thread.
+    constexpr const std::size_t min_parallel_sort_size = 64 * 1024;
+
+    inline void join_all(std::vector<std::thread>& threads) {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    /**
+     * Merge the sorted ranges [first1, last1) and [first2, last2) into
+     * the range starting at out. The work is split into num_parts
+     * independent merges which are started as threads.
+     */
+    template <typename TIterator, typename TCompare>
+    void start_parallel_merge(TIterator first1, TIterator last1,
+                              TIterator first2, TIterator last2,
+                              TIterator out, TCompare compare,
+                              std::size_t num_parts,
+                              std::vector<std::thread>& threads) {
+        const std::size_t size1 = last1 - first1;
+        if (num_parts > size1) {
+            num_parts = size1 == 0 ? 1 : size1;
+        }
+
+        auto begin1 = first1;
+        auto begin2 = first2;
+        for (std::size_t part = 1; part <= num_parts; ++part) {
+            auto end1 = last1;
+            auto end2 = last2;
+            if (part < num_parts) {
+                end1 = first1 + size1 * part / num_parts;
+                end2 = std::lower_bound(begin2, last2, *end1, compare);
+            }
+            const auto dest = out + ((begin1 - first1) + (begin2 - first2));
+            threads.emplace_back([begin1, end1, begin2, end2, dest, compare]() {
+                std::merge(begin1, end1, begin2, end2, dest, compare);
+            });
+            begin1 = end1;
+            begin2 = end2;
+        }
+    }
+
+} // namespace detail
+
+/**
+ * Sort the data using up to num_threads threads.
+ *
+ * The data is split into one chunk per thread and the chunks are sorted
+ * in parallel using the chunk_sort function, which is called with the
+ * begin and end iterators of a chunk. Then neighbouring chunks are merged
+ * pairwise using the compare function until only one is left. The merges
+ * are split up so that all threads are kept busy even in the last rounds.
+ * This needs a temporary copy of the data.
+ */
+template <typename T, typename TCompare, typename TChunkSort>
+void parallel_sort(std::vector<T>& data, TCompare compare, unsigned int num_threads, TChunkSort chunk_sort) {
+    if (num_threads <= 1 || data.size() < detail::min_parallel_sort_size) {
+        chunk_sort(data.begin(), data.end());
+        return;
+    }
+
+    std::vector<std::size_t> bounds;
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        bounds.push_back(data.size() * i / num_threads);
+    }
+    bounds.push_back(data.size());
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i + 1 < bounds.size(); ++i) {
+        const auto first = data.begin() + bounds[i];
+        const auto last = data.begin() + bounds[i + 1];
+        threads.emplace_back([first, last, chunk_sort]() {
+            chunk_sort(first, last);
+        });
+    }
+    detail::join_all(threads);
+
+    std::vector<T> temp(data.size());
+    while (bounds.size() > 2) {
+        const std::size_t num_pairs = (bounds.size() - 1) / 2;
+        const std::size_t parts_per_pair = std::max(std::size_t(1), num_threads / num_pairs);
+
+        std::vector<std::size_t> new_bounds;
+        std::size_t i = 0;
+        for (; i + 2 < bounds.size(); i += 2) {
+            detail::start_parallel_merge(data.begin() + bounds[i], data.begin() + bounds[i + 1],
+                                         data.begin() + bounds[i + 1], data.begin() + bounds[i + 2],
+                                         temp.begin() + bounds[i], compare,
+                                         parts_per_pair, threads);
+            new_bounds.push_back(bounds[i]);
+        }
+        if (i + 1 < bounds.size()) {
+            // odd number of chunks, the last one is copied unchanged
+            std::copy(data.begin() + bounds[i], data.end(), temp.begin() + bounds[i]);
+            new_bounds.push_back(bounds[i]);
+        }
+        new_bounds.push_back(data.size());
+
+        detail::join_all(threads);
+        data.swap(temp);
+        bounds.swap(new_bounds);
+    }
+}
+
+/**
+ * Sort the data using up to num_threads threads. Chunks are sorted with
+ * std::sort.
+ */
+template <typename T, typename TCompare>
+void parallel_sort(std::vector<T>& data, TCompare compare, unsigned int num_threads) {
+    using iterator = typename std::vector<T>::iterator;
+    parallel_sort(data, compare, num_threads, [compare](iterator first, iterator last) {
+        std::sort(first, last, compare);
+    });
+}
+
+#endif // PARALLEL_SORT_HPP
@@ -0,0 +1,520 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <limits>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include <protozero/pbf_reader.hpp>
+#include <protozero/types.hpp>
+
+#include <osmium/io/detail/output_format.hpp>
+#include <osmium/io/detail/pbf.hpp>
+#include <osmium/io/detail/queue_util.hpp>
+#include <osmium/io/detail/read_write.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/io/pbf_input.hpp>
+#include <osmium/io/pbf_output.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/io/writer_options.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+
+#include "pbf_blocks.hpp"
+
+namespace {
+
+    // Field numbers from the OSM PBF format definition (fileformat.proto
+    // and osmformat.proto).
+    namespace tag {
+        constexpr const protozero::pbf_tag_type blob_header_type         = 1;
+        constexpr const protozero::pbf_tag_type blob_header_datasize     = 3;
+
+        constexpr const protozero::pbf_tag_type blob_raw                 = 1;
+        constexpr const protozero::pbf_tag_type blob_raw_size            = 2;
+        constexpr const protozero::pbf_tag_type blob_zlib_data           = 3;
+        constexpr const protozero::pbf_tag_type blob_lzma_data           = 4;
+
+        constexpr const protozero::pbf_tag_type block_primitivegroup     = 2;
+        constexpr const protozero::pbf_tag_type block_granularity        = 17;
+        constexpr const protozero::pbf_tag_type block_lat_offset         = 19;
+        constexpr const protozero::pbf_tag_type block_lon_offset         = 20;
+
+        constexpr const protozero::pbf_tag_type group_nodes              = 1;
+        constexpr const protozero::pbf_tag_type group_dense              = 2;
+        constexpr const protozero::pbf_tag_type group_ways               = 3;
+        constexpr const protozero::pbf_tag_type group_relations          = 4;
+
+        // same for Node, Way, Relation, and DenseNodes
+        constexpr const protozero::pbf_tag_type object_id                = 1;
+
+        // same for Node and DenseNodes
+        constexpr const protozero::pbf_tag_type node_lat                 = 8;
+        constexpr const protozero::pbf_tag_type node_lon                 = 9;
+    } // namespace tag
+
+    void read_exactly(std::FILE* file, char* data, std::size_t size) {
+        if (size > 0 && std::fread(data, 1, size, file) != size) {
+            if (std::ferror(file)) {
+                throw std::system_error{errno, std::system_category(), "Read failed"};
+            }
+            throw osmium::pbf_error{"truncated data (EOF encountered)"};
+        }
+    }
+
+    protozero::data_view uncompress_blob(const protozero::data_view& blob, std::string& output) {
+        protozero::pbf_reader reader{blob};
+        protozero::data_view zlib_data;
+        int32_t raw_size = 0;
+
+        while (reader.next()) {
+            switch (reader.tag()) {
+                case tag::blob_raw:
+                    return reader.get_view();
+                case tag::blob_raw_size:
+                    raw_size = reader.get_int32();
+                    if (raw_size < 0 || static_cast<std::size_t>(raw_size) > osmium::io::detail::max_uncompressed_blob_size) {
+                        throw osmium::pbf_error{"illegal blob size"};
+                    }
+                    break;
+                case tag::blob_zlib_data:
+                    zlib_data = reader.get_view();
+                    break;
+                case tag::blob_lzma_data:
+                    throw osmium::pbf_error{"lzma blobs not implemented"};
+                default:
+                    reader.skip();
+            }
+        }
+
+        if (zlib_data.data() == nullptr) {
+            throw osmium::pbf_error{"blob contains no data"};
+        }
+
+        output.resize(static_cast<std::size_t>(raw_size));
+        uLongf output_size = static_cast<uLongf>(raw_size);
+        const auto result = ::uncompress(reinterpret_cast<Bytef*>(&*output.begin()),
+                                         &output_size,
+                                         reinterpret_cast<const Bytef*>(zlib_data.data()),
+                                         static_cast<uLong>(zlib_data.size()));
+        if (result != Z_OK || output_size != static_cast<uLongf>(raw_size)) {
+            throw osmium::pbf_error{"failed to uncompress blob"};
+        }
+
+        return protozero::data_view{output.data(), output.size()};
+    }
+
+    class key_range {
+
+        pbf_object_key m_first{osmium::item_type::undefined, 0};
+        pbf_object_key m_last{osmium::item_type::undefined, 0};
+        bool m_empty = true;
+
+    public:
+
+        void add(osmium::item_type type, osmium::object_id_type id) noexcept {
+            const pbf_object_key key{type, id};
+            if (m_empty) {
+                m_first = key;
+                m_last = key;
+                m_empty = false;
+                return;
+            }
+            if (key < m_first) {
+                m_first = key;
+            }
+            if (m_last < key) {
+                m_last = key;
+            }
+        }
+
+        bool empty() const noexcept {
+            return m_empty;
+        }
+
+        const pbf_object_key& first() const noexcept {
+            return m_first;
+        }
+
+        const pbf_object_key& last() const noexcept {
+            return m_last;
+        }
+
+    }; // class key_range
+
+    // The smallest and largest raw latitude and longitude of the nodes
+    // in a block. They still have to be converted using the granularity
+    // and offsets of the block.
+    class raw_location_range {
+
+        int64_t m_min_lat = std::numeric_limits<int64_t>::max();
+        int64_t m_max_lat = std::numeric_limits<int64_t>::min();
+        int64_t m_min_lon = std::numeric_limits<int64_t>::max();
+        int64_t m_max_lon = std::numeric_limits<int64_t>::min();
+
+        // Convert from units of granularity nanodegrees to the units of
+        // osmium::Location rounding outwards. This uses the internal
+        // osmium::detail::coordinate_precision from libosmium, the same
+        // constant its PBF parser uses for this conversion, so the
+        // envelopes match the decoded locations exactly. If libosmium ever
+        // changes it the extract tests on the PBF block envelopes catch it.
+        static int32_t to_coordinate(int64_t raw, int64_t offset, int64_t granularity, bool round_up) noexcept {
+            constexpr const int64_t nano_per_unit = 1000000000 / osmium::detail::coordinate_precision;
+            const int64_t nano = offset + granularity * raw;
+            int64_t value = nano / nano_per_unit;
+            if (round_up && nano % nano_per_unit > 0) {
+                ++value;
+            } else if (!round_up && nano % nano_per_unit < 0) {
+                --value;
+            }
+            return static_cast<int32_t>(std::max(int64_t(std::numeric_limits<int32_t>::min()),
+                                                 std::min(int64_t(std::numeric_limits<int32_t>::max()), value)));
+        }
+
+    public:
+
+        void add_lat(int64_t lat) noexcept {
+            m_min_lat = std::min(m_min_lat, lat);
+            m_max_lat = std::max(m_max_lat, lat);
+        }
+
+        void add_lon(int64_t lon) noexcept {
+            m_min_lon = std::min(m_min_lon, lon);
+            m_max_lon = std::max(m_max_lon, lon);
+        }
+
+        bool empty() const noexcept {
+            return m_min_lat > m_max_lat || m_min_lon > m_max_lon;
+        }
+
+        osmium::Box envelope(int64_t granularity, int64_t lat_offset, int64_t lon_offset) const noexcept {
+            if (empty()) {
+                return osmium::Box{};
+            }
+            return osmium::Box{
+                osmium::Location{to_coordinate(m_min_lon, lon_offset, granularity, false),
+                                 to_coordinate(m_min_lat, lat_offset, granularity, false)},
+                osmium::Location{to_coordinate(m_max_lon, lon_offset, granularity, true),
+                                 to_coordinate(m_max_lat, lat_offset, granularity, true)}
+            };
+        }
+
+    }; // class raw_location_range
+
+    void add_object_id(protozero::pbf_reader object, osmium::item_type type, key_range& range) {
+        if (object.next(tag::object_id)) {
+            range.add(type, type == osmium::item_type::node ? object.get_sint64() : object.get_int64());
+        }
+    }
+
+    void add_node(protozero::pbf_reader node, key_range& range, raw_location_range* locations) {
+        while (node.next()) {
+            switch (node.tag()) {
+                case tag::object_id:
+                    range.add(osmium::item_type::node, node.get_sint64());
+                    if (!locations) {
+                        return;
+                    }
+                    break;
+                case tag::node_lat:
+                    if (locations) {
+                        locations->add_lat(node.get_sint64());
+                    } else {
+                        node.skip();
+                    }
+                    break;
+                case tag::node_lon:
+                    if (locations) {
+                        locations->add_lon(node.get_sint64());
+                    } else {
+                        node.skip();
+                    }
+                    break;
+                default:
+                    node.skip();
+            }
+        }
+    }
+
+    void add_dense_nodes(protozero::pbf_reader dense, key_range& range, raw_location_range* locations) {
+        while (dense.next()) {
+            int64_t value = 0;
+            switch (dense.tag()) {
+                case tag::object_id:
+                    for (const auto delta : dense.get_packed_sint64()) {
+                        value += delta;
+                        range.add(osmium::item_type::node, value);
+                    }
+                    break;
+                case tag::node_lat:
+                    if (!locations) {
+                        dense.skip();
+                        break;
+                    }
+                    for (const auto delta : dense.get_packed_sint64()) {
+                        value += delta;
+                        locations->add_lat(value);
+                    }
+                    break;
+                case tag::node_lon:
+                    if (!locations) {
+                        dense.skip();
+                        break;
+                    }
+                    for (const auto delta : dense.get_packed_sint64()) {
+                        value += delta;
+                        locations->add_lon(value);
+                    }
+                    break;
+                default:
+                    dense.skip();
+            }
+        }
+    }
+
+    void scan_primitive_group(protozero::pbf_reader group, key_range& range, raw_location_range* locations) {
+        while (group.next()) {
+            switch (group.tag()) {
+                case tag::group_nodes:
+                    add_node(group.get_message(), range, locations);
+                    break;
+                case tag::group_dense:
+                    add_dense_nodes(group.get_message(), range, locations);
+                    break;
+                case tag::group_ways:
+                    add_object_id(group.get_message(), osmium::item_type::way, range);
+                    break;
+                case tag::group_relations:
+                    add_object_id(group.get_message(), osmium::item_type::relation, range);
+                    break;
+                default:
+                    group.skip();
+            }
+        }
+    }
+
+    // Find the smallest and largest (type, ID) in a PrimitiveBlock. Only
+    // the IDs are looked at, everything else is skipped. If node_envelope
+    // is not nullptr, the node locations are looked at, too, and it is set
+    // to the bounding box of all nodes.
+    key_range scan_primitive_block(const protozero::data_view& data, osmium::Box* node_envelope) {
+        key_range range;
+        raw_location_range locations;
+        int64_t granularity = 100;
+        int64_t lat_offset = 0;
+        int64_t lon_offset = 0;
+
+        protozero::pbf_reader block{data};
+        while (block.next()) {
+            switch (block.tag()) {
+                case tag::block_primitivegroup:
+                    scan_primitive_group(block.get_message(), range, node_envelope ? &locations : nullptr);
+                    break;
+                case tag::block_granularity:
+                    granularity = block.get_int32();
+                    break;
+                case tag::block_lat_offset:
+                    lat_offset = block.get_int64();
+                    break;
+                case tag::block_lon_offset:
+                    lon_offset = block.get_int64();
+                    break;
+                default:
+                    block.skip();
+            }
+        }
+
+        if (node_envelope) {
+            *node_envelope = locations.envelope(granularity, lat_offset, lon_offset);
+        }
+
+        return range;
+    }
+
+    std::string collect_output(osmium::io::detail::future_string_queue_type& queue) {
+        std::string data;
+        while (!queue.empty()) {
+            std::future<std::string> future;
+            queue.wait_and_pop(future);
+            data += future.get();
+        }
+        return data;
+    }
+
+} // anonymous namespace
+
+PBFBlockReader::PBFBlockReader(const std::string& filename, bool with_node_envelopes) :
+    m_file(filename.empty() || filename == "-" ? stdin : std::fopen(filename.c_str(), "rb")),
+    m_with_node_envelopes(with_node_envelopes) {
+    if (!m_file) {
+        throw std::system_error{errno, std::system_category(), std::string{"Open failed for '"} + filename + "'"};
+    }
+
+    std::string type;
+    std::size_t blob_offset = 0;
+    if (!read_block(type, m_header_block, blob_offset) || type != "OSMHeader") {
+        throw osmium::pbf_error{"OSMHeader block expected"};
+    }
+}
+
+bool PBFBlockReader::read_block(std::string& type, std::string& data, std::size_t& blob_offset) {
+    unsigned char size_bytes[4];
+    const auto count = std::fread(size_bytes, 1, sizeof(size_bytes), m_file.get());
+    if (count == 0 && std::feof(m_file.get())) {
+        return false;
+    }
+    read_exactly(m_file.get(), reinterpret_cast<char*>(size_bytes) + count, sizeof(size_bytes) - count);
+
+    const std::size_t header_size = (static_cast<std::size_t>(size_bytes[0]) << 24U) |
+                                    (static_cast<std::size_t>(size_bytes[1]) << 16U) |
+                                    (static_cast<std::size_t>(size_bytes[2]) <<  8U) |
+                                     static_cast<std::size_t>(size_bytes[3]);
+    if (header_size > osmium::io::detail::max_blob_header_size) {
+        throw osmium::pbf_error{"invalid BlobHeader size (> max_blob_header_size)"};
+    }
+
+    data.assign(reinterpret_cast<const char*>(size_bytes), sizeof(size_bytes));
+    data.resize(sizeof(size_bytes) + header_size);
+    read_exactly(m_file.get(), &data[sizeof(size_bytes)], header_size);
+
+    type.clear();
+    int32_t blob_size = -1;
+    protozero::pbf_reader header{data.data() + sizeof(size_bytes), header_size};
+    while (header.next()) {
+        switch (header.tag()) {
+            case tag::blob_header_type:
+                type = header.get_string();
+                break;
+            case tag::blob_header_datasize:
+                blob_size = header.get_int32();
+                break;
+            default:
+                header.skip();
+        }
+    }
+
+    if (blob_size < 0 || static_cast<std::size_t>(blob_size) > osmium::io::detail::max_uncompressed_blob_size) {
+        throw osmium::pbf_error{"invalid blob size"};
+    }
+
+    blob_offset = data.size();
+    data.resize(blob_offset + static_cast<std::size_t>(blob_size));
+    read_exactly(m_file.get(), &data[blob_offset], static_cast<std::size_t>(blob_size));
+    m_offset += data.size();
+
+    return true;
+}
+
+bool PBFBlockReader::read(PBFBlock& block) {
+    std::string type;
+    std::size_t blob_offset = 0;
+    if (!read_block(type, block.m_data, blob_offset)) {
+        return false;
+    }
+    if (type != "OSMData") {
+        throw osmium::pbf_error{"unknown blob type"};
+    }
+
+    const protozero::data_view blob{block.m_data.data() + blob_offset, block.m_data.size() - blob_offset};
+    block.m_node_envelope = osmium::Box{};
+    const auto range = scan_primitive_block(uncompress_blob(blob, m_uncompressed),
+                                            m_with_node_envelopes ? &block.m_node_envelope : nullptr);
+
+    block.m_has_objects = !range.empty();
+    block.m_first = range.first();
+    block.m_last = range.last();
+
+    return true;
+}
+
+std::vector<osmium::memory::Buffer> decode_pbf_blocks(const std::string& header_block, const std::vector<PBFBlock>& blocks) {
+    std::string data{header_block};
+    for (const auto& block : blocks) {
+        data += block.data();
+    }
+
+    std::vector<osmium::memory::Buffer> buffers;
+    osmium::io::Reader reader{osmium::io::File{data.data(), data.size(), "pbf"}, osmium::osm_entity_bits::object};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        buffers.push_back(std::move(buffer));
+    }
+    reader.close();
+
+    return buffers;
+}
+
+PBFBlockWriter::PBFBlockWriter(const osmium::io::File& file, osmium::io::overwrite allow_overwrite) :
+    m_file(file),
+    m_fd(osmium::io::detail::open_for_writing(file.filename(), allow_overwrite)) {
+}
+
+PBFBlockWriter::~PBFBlockWriter() noexcept {
+    if (m_fd >= 0) {
+        try {
+            osmium::io::detail::reliable_close(m_fd);
+        } catch (...) {
+            // Ignore any exceptions because destructor must not throw.
+        }
+    }
+}
+
+void PBFBlockWriter::write(const std::string& data) {
+    osmium::io::detail::reliable_write(m_fd, data.data(), data.size());
+}
+
+void PBFBlockWriter::write_header(const osmium::io::Header& header) {
+    osmium::io::detail::future_string_queue_type queue;
+    const auto output = osmium::io::detail::OutputFormatFactory::instance().create_output(m_file, queue);
+    output->write_header(header);
+    write(collect_output(queue));
+}
+
+void PBFBlockWriter::write_objects(osmium::memory::Buffer&& buffer) {
+    osmium::io::detail::future_string_queue_type queue;
+    const auto output = osmium::io::detail::OutputFormatFactory::instance().create_output(m_file, queue);
+    output->write_buffer(std::move(buffer));
+    output->write_end();
+    write(collect_output(queue));
+}
+
+void PBFBlockWriter::close(osmium::io::fsync sync) {
+    const int fd = m_fd;
+    m_fd = -1;
+    if (sync == osmium::io::fsync::yes) {
+        osmium::io::detail::reliable_fsync(fd);
+    }
+    osmium::io::detail::reliable_close(fd);
+}
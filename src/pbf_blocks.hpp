@@ -0,0 +1,206 @@
+#ifndef PBF_BLOCKS_HPP
+#define PBF_BLOCKS_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <osmium/io/file.hpp>
+#include <osmium/io/writer_options.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/types.hpp>
+
+/**
+ * Type and ID of an OSM object. Ordered in the same way as
+ * osmium::OSMObject, but without looking at the version.
+ */
+struct pbf_object_key {
+    osmium::item_type type;
+    osmium::object_id_type id;
+};
+
+inline bool operator<(const pbf_object_key& lhs, const pbf_object_key& rhs) noexcept {
+    if (lhs.type != rhs.type) {
+        return lhs.type < rhs.type;
+    }
+    if ((lhs.id > 0) != (rhs.id > 0)) {
+        return rhs.id > 0;
+    }
+    return lhs.id > 0 ? lhs.id < rhs.id : lhs.id > rhs.id;
+}
+
+/**
+ * One block of a PBF file as it is stored on disk (the size, BlobHeader,
+ * and Blob). For data blocks the smallest and largest (type, ID) of the
+ * objects in the block are available without decoding the objects.
+ */
+class PBFBlock {
+
+    std::string m_data;
+    pbf_object_key m_first{osmium::item_type::undefined, 0};
+    pbf_object_key m_last{osmium::item_type::undefined, 0};
+    osmium::Box m_node_envelope;
+    bool m_has_objects = false;
+
+    friend class PBFBlockReader;
+
+public:
+
+    // The raw block data which can be written to a PBF file unchanged.
+    const std::string& data() const noexcept {
+        return m_data;
+    }
+
+    bool has_objects() const noexcept {
+        return m_has_objects;
+    }
+
+    const pbf_object_key& first() const noexcept {
+        return m_first;
+    }
+
+    const pbf_object_key& last() const noexcept {
+        return m_last;
+    }
+
+    // True if the block contains nodes only.
+    bool only_nodes() const noexcept {
+        return m_has_objects && m_last.type == osmium::item_type::node;
+    }
+
+    // The bounding box of the locations of all nodes in the block. Only
+    // available if the reader was asked for it, otherwise (and if there
+    // are no nodes in the block) the box is invalid.
+    const osmium::Box& node_envelope() const noexcept {
+        return m_node_envelope;
+    }
+
+}; // class PBFBlock
+
+/**
+ * Reads a PBF file block by block. Data blocks are decompressed to find
+ * the IDs of the objects in them, but the objects are not decoded. If
+ * with_node_envelopes is set, the node locations are looked at, too, to
+ * find the bounding box of the nodes in each block.
+ */
+class PBFBlockReader {
+
+    struct file_closer {
+        void operator()(std::FILE* file) const noexcept {
+            if (file != stdin) {
+                std::fclose(file);
+            }
+        }
+    };
+
+    std::unique_ptr<std::FILE, file_closer> m_file;
+    std::string m_header_block;
+    std::string m_uncompressed;
+    std::size_t m_offset = 0;
+    bool m_with_node_envelopes;
+
+    bool read_block(std::string& type, std::string& data, std::size_t& blob_offset);
+
+public:
+
+    // Open the file and read the header block. An empty file name or "-"
+    // reads from STDIN.
+    explicit PBFBlockReader(const std::string& filename, bool with_node_envelopes = false);
+
+    // The raw OSMHeader block of the file.
+    const std::string& header_block() const noexcept {
+        return m_header_block;
+    }
+
+    // Read the next data block. Returns false at the end of the file.
+    bool read(PBFBlock& block);
+
+    // The number of bytes read from the file so far.
+    std::size_t offset() const noexcept {
+        return m_offset;
+    }
+
+}; // class PBFBlockReader
+
+/**
+ * Decode the objects in the given data blocks. The header block of the
+ * file they are from is needed, too.
+ */
+std::vector<osmium::memory::Buffer> decode_pbf_blocks(const std::string& header_block, const std::vector<PBFBlock>& blocks);
+
+/**
+ * Writes a PBF file block by block. Blocks read with a PBFBlockReader can
+ * be copied unchanged, objects are encoded into new blocks using the
+ * format options from the file.
+ *
+ * There is no public libosmium interface for writing raw PBF blocks, so
+ * this class (and the reader) use some of the internals from the
+ * osmium::io::detail namespace. All uses of those are in pbf_blocks.cpp
+ * and might have to be adapted when updating libosmium.
+ */
+class PBFBlockWriter {
+
+    osmium::io::File m_file;
+    int m_fd;
+
+    void write(const std::string& data);
+
+public:
+
+    // Open the file for writing. An empty file name or "-" writes to
+    // STDOUT.
+    PBFBlockWriter(const osmium::io::File& file, osmium::io::overwrite allow_overwrite);
+
+    PBFBlockWriter(const PBFBlockWriter&) = delete;
+    PBFBlockWriter& operator=(const PBFBlockWriter&) = delete;
+
+    PBFBlockWriter(PBFBlockWriter&&) = delete;
+    PBFBlockWriter& operator=(PBFBlockWriter&&) = delete;
+
+    // Closes the file if close() wasn't called. Errors are ignored.
+    ~PBFBlockWriter() noexcept;
+
+    // Encode the header into a PBF header block and write it.
+    void write_header(const osmium::io::Header& header);
+
+    // Encode the objects in the buffer into PBF data blocks and write
+    // them.
+    void write_objects(osmium::memory::Buffer&& buffer);
+
+    // Write a block read from another PBF file unchanged.
+    void copy_block(const PBFBlock& block) {
+        write(block.data());
+    }
+
+    void close(osmium::io::fsync sync);
+
+}; // class PBFBlockWriter
+
+#endif // PBF_BLOCKS_HPP
@@ -0,0 +1,189 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <osmium/osm/object.hpp>
+
+#include "parallel_sort.hpp"
+#include "sort_keys.hpp"
+
+namespace {
+
+    constexpr const std::uint64_t max_key_id = 1ULL << 60U;
+
+    // Number of bytes in a key used for the radix sort: 4 bytes version
+    // and 8 bytes type_id.
+    constexpr const int num_digits = 12;
+
+    // Below this size the radix sort isn't worth it.
+    constexpr const std::size_t min_radix_sort_size = 256;
+
+    using iterator = std::vector<sort_key>::iterator;
+
+    unsigned int digit(const sort_key& key, int n) noexcept {
+        if (n < 4) {
+            return (key.version >> (8U * n)) & 0xffU;
+        }
+        return (key.type_id >> (8U * (n - 4))) & 0xffU;
+    }
+
+    bool key_less(const sort_key& lhs, const sort_key& rhs) noexcept {
+        if (lhs.type_id != rhs.type_id) {
+            return lhs.type_id < rhs.type_id;
+        }
+        return lhs.version < rhs.version;
+    }
+
+    bool key_equal(const sort_key& lhs, const sort_key& rhs) noexcept {
+        return lhs.type_id == rhs.type_id && lhs.version == rhs.version;
+    }
+
+    // LSD radix sort on the keys. Digits that are the same in all keys
+    // (which is common for the type and the upper bytes of IDs and
+    // versions) are skipped.
+    void radix_sort(iterator first, iterator last) {
+        const std::size_t size = last - first;
+        if (size < min_radix_sort_size) {
+            std::sort(first, last, key_less);
+            return;
+        }
+
+        std::vector<std::array<std::size_t, 256>> counts(num_digits);
+        for (auto& c : counts) {
+            c.fill(0);
+        }
+        for (auto it = first; it != last; ++it) {
+            for (int n = 0; n < num_digits; ++n) {
+                ++counts[n][digit(*it, n)];
+            }
+        }
+
+        std::vector<sort_key> temp(size);
+        sort_key* src = &*first;
+        sort_key* dest = temp.data();
+
+        for (int n = 0; n < num_digits; ++n) {
+            auto& count = counts[n];
+            if (std::find(count.cbegin(), count.cend(), size) != count.cend()) {
+                continue;
+            }
+
+            std::size_t offset = 0;
+            for (auto& c : count) {
+                const auto num = c;
+                c = offset;
+                offset += num;
+            }
+
+            for (std::size_t i = 0; i < size; ++i) {
+                dest[count[digit(src[i], n)]++] = src[i];
+            }
+            std::swap(src, dest);
+        }
+
+        if (src != &*first) {
+            std::copy(src, src + size, first);
+        }
+    }
+
+    // After the radix sort keys with the same type, ID, and version are
+    // sorted by comparing the objects themselves.
+    void sort_equal_keys(iterator first, iterator last, sort_order order) {
+        const object_order_less less{order};
+        while (first != last) {
+            auto next = first + 1;
+            while (next != last && key_equal(*first, *next)) {
+                ++next;
+            }
+            if (next - first > 1) {
+                std::sort(first, next, [less](const sort_key& lhs, const sort_key& rhs) {
+                    return less(*lhs.object, *rhs.object);
+                });
+            }
+            first = next;
+        }
+    }
+
+} // anonymous namespace
+
+void SortKeyCollection::osm_object(const osmium::OSMObject& object) {
+    sort_key key{0, 0, &object};
+
+    const std::uint64_t id = object.positive_id();
+    if (id < max_key_id) {
+        key.type_id = (static_cast<std::uint64_t>(object.type()) << 61U) |
+                      (object.id() > 0 ? max_key_id : 0) |
+                      id;
+        key.version = m_order == sort_order::type_id_version ?
+                      object.version() :
+                      std::numeric_limits<std::uint32_t>::max() - object.version();
+    } else {
+        m_keys_complete = false;
+    }
+
+    m_keys.push_back(key);
+}
+
+void SortKeyCollection::sort(unsigned int num_threads) {
+    const auto order = m_order;
+    const object_order_less less{order};
+
+    if (!m_keys_complete) {
+        parallel_sort(m_keys, [less](const sort_key& lhs, const sort_key& rhs) {
+            return less(*lhs.object, *rhs.object);
+        }, num_threads);
+        return;
+    }
+
+    parallel_sort(m_keys, [less](const sort_key& lhs, const sort_key& rhs) {
+        if (key_equal(lhs, rhs)) {
+            return less(*lhs.object, *rhs.object);
+        }
+        return key_less(lhs, rhs);
+    }, num_threads, [order](iterator first, iterator last) {
+        radix_sort(first, last);
+        sort_equal_keys(first, last, order);
+    });
+}
+
+void SortKeyCollection::unique() {
+    if (m_keys_complete) {
+        m_keys.erase(std::unique(m_keys.begin(), m_keys.end(), [](const sort_key& lhs, const sort_key& rhs) {
+            return lhs.type_id == rhs.type_id;
+        }), m_keys.end());
+    } else {
+        m_keys.erase(std::unique(m_keys.begin(), m_keys.end(), [](const sort_key& lhs, const sort_key& rhs) {
+            return osmium::object_equal_type_id{}(*lhs.object, *rhs.object);
+        }), m_keys.end());
+    }
+}
+
+void SortKeyCollection::clear() {
+    m_keys.clear();
+    m_keys_complete = true;
+}
@@ -0,0 +1,134 @@
+#ifndef SORT_KEYS_HPP
+#define SORT_KEYS_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/object_comparisons.hpp>
+
+/**
+ * The orders in which a SortKeyCollection can be sorted. They are the
+ * same as the osmium::object_order_type_id_version and
+ * osmium::object_order_type_id_reverse_version comparisons.
+ */
+enum class sort_order {
+    type_id_version,
+    type_id_reverse_version
+};
+
+/**
+ * Compares OSM objects in the given sort order.
+ */
+class object_order_less {
+
+    sort_order m_order;
+
+public:
+
+    explicit object_order_less(sort_order order = sort_order::type_id_version) noexcept :
+        m_order(order) {
+    }
+
+    bool operator()(const osmium::OSMObject& lhs, const osmium::OSMObject& rhs) const noexcept {
+        if (m_order == sort_order::type_id_version) {
+            return osmium::object_order_type_id_version{}(lhs, rhs);
+        }
+        return osmium::object_order_type_id_reverse_version{}(lhs, rhs);
+    }
+
+}; // class object_order_less
+
+/**
+ * Compact sort key for an OSM object.
+ *
+ * The type, the sign of the ID, and the absolute value of the ID are packed
+ * into one 64 bit integer in a way that sorting these integers gives the
+ * usual object order: type (3 bits), ID positive (1 bit), absolute value of
+ * ID (60 bits). The version (inverted for the reverse version order) is
+ * stored separately. Only keys with the same type, ID, and version have to
+ * look at the object itself to compare the timestamps.
+ */
+struct sort_key {
+    std::uint64_t type_id;
+    std::uint32_t version;
+    const osmium::OSMObject* object;
+};
+
+/**
+ * Collection of sort keys for OSM objects. Use it as a handler or call
+ * osm_object() to add objects.
+ *
+ * Sorting uses a radix sort on the keys, so the objects themselves, which
+ * are scattered all over memory, don't have to be accessed while sorting.
+ * If there are objects with IDs too large to fit into the key, a normal
+ * sort comparing the objects is used instead.
+ */
+class SortKeyCollection : public osmium::handler::Handler {
+
+    std::vector<sort_key> m_keys;
+    sort_order m_order;
+    bool m_keys_complete = true;
+
+public:
+
+    using const_iterator = std::vector<sort_key>::const_iterator;
+
+    explicit SortKeyCollection(sort_order order) :
+        m_order(order) {
+    }
+
+    void osm_object(const osmium::OSMObject& object);
+
+    // Sort using up to num_threads threads.
+    void sort(unsigned int num_threads = 1);
+
+    // Remove all but the first of consecutive objects with the same type
+    // and ID. Only useful after sorting.
+    void unique();
+
+    void clear();
+
+    std::size_t size() const noexcept {
+        return m_keys.size();
+    }
+
+    bool empty() const noexcept {
+        return m_keys.empty();
+    }
+
+    const_iterator begin() const noexcept {
+        return m_keys.cbegin();
+    }
+
+    const_iterator end() const noexcept {
+        return m_keys.cend();
+    }
+
+}; // class SortKeyCollection
+
+#endif // SORT_KEYS_HPP
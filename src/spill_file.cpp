@@ -0,0 +1,81 @@
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <system_error>
+
+#include <osmium/memory/buffer.hpp>
+
+#include "spill_file.hpp"
+
+SpillFile::SpillFile() :
+    m_file(std::tmpfile()) {
+    if (!m_file) {
+        throw std::system_error{errno, std::system_category(), "Could not create temporary file"};
+    }
+}
+
+SpillFile::~SpillFile() noexcept {
+    std::fclose(m_file);
+}
+
+void SpillFile::write(const osmium::memory::Buffer& buffer) {
+    const std::uint64_t size = buffer.committed();
+    if (size == 0) {
+        return;
+    }
+
+    if (std::fwrite(&size, sizeof(size), 1, m_file) != 1 ||
+        std::fwrite(buffer.data(), 1, size, m_file) != size) {
+        throw std::system_error{errno, std::system_category(), "Write to temporary file failed"};
+    }
+
+    m_size += sizeof(size) + size;
+}
+
+void SpillFile::rewind() {
+    if (std::fflush(m_file) != 0) {
+        throw std::system_error{errno, std::system_category(), "Write to temporary file failed"};
+    }
+    std::rewind(m_file);
+}
+
+osmium::memory::Buffer SpillFile::read() {
+    std::uint64_t size = 0;
+    if (std::fread(&size, sizeof(size), 1, m_file) != 1) {
+        if (std::ferror(m_file)) {
+            throw std::system_error{errno, std::system_category(), "Read from temporary file failed"};
+        }
+        return osmium::memory::Buffer{};
+    }
+
+    osmium::memory::Buffer buffer{static_cast<std::size_t>(size), osmium::memory::Buffer::auto_grow::no};
+    unsigned char* data = buffer.reserve_space(static_cast<std::size_t>(size));
+    if (std::fread(data, 1, static_cast<std::size_t>(size), m_file) != size) {
+        throw std::system_error{errno, std::system_category(), "Read from temporary file failed"};
+    }
+    buffer.commit();
+
+    return buffer;
+}
@@ -0,0 +1,79 @@
+#ifndef SPILL_FILE_HPP
+#define SPILL_FILE_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstddef>
+#include <cstdio>
+
+namespace osmium {
+    namespace memory {
+        class Buffer;
+    }
+}
+
+/**
+ * A temporary file used to move buffers out of main memory and read them
+ * back later. The buffer contents are written in their raw in-memory form,
+ * each buffer preceded by its size, so reading them back does not need any
+ * parsing. The file is removed automatically when this object is destroyed.
+ *
+ * Buffers are always read back in the order they were written. Call
+ * rewind() after the last write and before the first read.
+ */
+class SpillFile {
+
+    std::FILE* m_file;
+    std::size_t m_size = 0;
+
+public:
+
+    SpillFile();
+
+    ~SpillFile() noexcept;
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    SpillFile(SpillFile&&) = delete;
+    SpillFile& operator=(SpillFile&&) = delete;
+
+    // Write the committed contents of the buffer to the file. Empty
+    // buffers are ignored.
+    void write(const osmium::memory::Buffer& buffer);
+
+    // Go back to the beginning of the file to start reading.
+    void rewind();
+
+    // Read the next buffer from the file. Returns an invalid buffer
+    // when the end of the file is reached.
+    osmium::memory::Buffer read();
+
+    // The number of bytes written to the file so far.
+    std::size_t size() const noexcept {
+        return m_size;
+    }
+
+}; // class SpillFile
+
+#endif // SPILL_FILE_HPP
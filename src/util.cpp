@@ -23,6 +23,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <osmium/io/file.hpp>
@@ -65,6 +66,11 @@ void warning(const std::string& text) {
     std::cerr << "WARNING: " << text;
 }
 
+unsigned int default_num_threads() noexcept {
+    const unsigned int num_threads = std::thread::hardware_concurrency();
+    return num_threads > 0 ? num_threads : 1;
+}
+
 std::size_t file_size_sum(const std::vector<osmium::io::File>& files) {
     std::size_t sum = 0;
 
@@ -46,6 +46,7 @@ std::string get_filename_suffix(const std::string& file_name);
 const char* yes_no(bool choice) noexcept;
 void warning(const char* text);
 void warning(const std::string& text);
+unsigned int default_num_threads() noexcept;
 std::size_t file_size_sum(const std::vector<osmium::io::File>& files);
 osmium::osm_entity_bits::type get_types(const std::string& s);
 std::pair<osmium::osm_entity_bits::type, std::string> get_filter_expression(const std::string& s);
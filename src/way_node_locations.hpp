@@ -0,0 +1,169 @@
+#ifndef WAY_NODE_LOCATIONS_HPP
+#define WAY_NODE_LOCATIONS_HPP
+
+/*
+
+Osmium -- OpenStreetMap data manipulation command line tool
+http://osmcode.org/osmium-tool/
+
+Copyright (C) 2013-2017  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <osmium/index/index.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/node_ref.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/visitor.hpp>
+
+/**
+ * Looks up the locations for the nodes of many ways together.
+ *
+ * When the ways are handled one after the other, the location index is
+ * accessed in essentially random order and on large indexes almost every
+ * lookup has to wait for main memory. Here the node references of all
+ * ways are collected first and sorted by node ID, so the index is accessed
+ * in ID order. For the array based indexes the memory is then read front
+ * to back which the hardware prefetcher can follow, for the other indexes
+ * the parts needed next are likely to still be in the cache. Each node ID
+ * is only looked up once.
+ */
+class WayNodeLocations {
+
+    std::vector<std::pair<osmium::object_id_type, osmium::NodeRef*>> m_node_refs;
+
+public:
+
+    // What happens to node refs without a known location.
+    enum class missing_location {
+        keep,      // keep the location they have
+        invalidate // set to an invalid location
+    };
+
+    void add(osmium::Way& way) {
+        for (auto& node_ref : way.nodes()) {
+            m_node_refs.emplace_back(node_ref.ref(), &node_ref);
+        }
+    }
+
+    bool empty() const noexcept {
+        return m_node_refs.empty();
+    }
+
+    /**
+     * Set the locations of all node refs added since the last call.
+     * The lookup function is called with a node ID and must return the
+     * location of this node or an invalid location if it isn't known.
+     * Node refs without a known location are left unchanged or set to an
+     * invalid location depending on the missing_mode argument.
+     *
+     * Returns the number of node refs for which no location was found.
+     */
+    template <typename TLookup>
+    std::size_t set_locations(TLookup&& lookup, missing_location missing_mode = missing_location::keep) {
+        std::sort(m_node_refs.begin(), m_node_refs.end(), [](const std::pair<osmium::object_id_type, osmium::NodeRef*>& lhs,
+                                                             const std::pair<osmium::object_id_type, osmium::NodeRef*>& rhs) {
+            return lhs.first < rhs.first;
+        });
+
+        std::size_t missing = 0;
+        auto it = m_node_refs.cbegin();
+        while (it != m_node_refs.cend()) {
+            const auto id = it->first;
+            const osmium::Location location = lookup(id);
+            for (; it != m_node_refs.cend() && it->first == id; ++it) {
+                if (location) {
+                    it->second->set_location(location);
+                } else {
+                    if (missing_mode == missing_location::invalidate) {
+                        it->second->set_location(osmium::Location{});
+                    }
+                    ++missing;
+                }
+            }
+        }
+
+        m_node_refs.clear();
+        return missing;
+    }
+
+}; // class WayNodeLocations
+
+/**
+ * Set the locations for the nodes of the ways in the range [first, last)
+ * of way pointers from a osmium::handler::NodeLocationsForWays handler.
+ * This does the same as calling the way() function of the handler for
+ * each way, but looks up the locations together using WayNodeLocations.
+ * Like in the handler the locations of nodes not found in the index are
+ * set to an invalid location.
+ *
+ * The location index is only read here, so this can be called for
+ * different ranges from several threads at the same time. But the way()
+ * function of the handler has to be called at least once before, because
+ * it sorts the index if needed.
+ */
+template <typename TIterator, typename TLocationHandler>
+void set_way_node_locations(TIterator first, TIterator last, const TLocationHandler& location_handler, bool ignore_errors) {
+    WayNodeLocations node_locations;
+    for (; first != last; ++first) {
+        node_locations.add(**first);
+    }
+
+    const auto missing = node_locations.set_locations([&location_handler](osmium::object_id_type id) {
+        return location_handler.get_node_location(id);
+    }, WayNodeLocations::missing_location::invalidate);
+
+    if (missing > 0 && !ignore_errors) {
+        throw osmium::not_found{"location for one or more nodes not found in node location index"};
+    }
+}
+
+/**
+ * Like osmium::apply(buffer, location_handler), but the locations for
+ * the nodes of ways in buffers without nodes are looked up together
+ * using set_way_node_locations().
+ */
+template <typename TLocationHandler>
+void apply_location_handler(osmium::memory::Buffer& buffer, TLocationHandler& location_handler, bool ignore_errors) {
+    std::vector<osmium::Way*> ways;
+    for (auto& item : buffer) {
+        if (item.type() == osmium::item_type::node) {
+            osmium::apply(buffer, location_handler);
+            return;
+        }
+        if (item.type() == osmium::item_type::way) {
+            ways.push_back(&static_cast<osmium::Way&>(item));
+        }
+    }
+
+    if (ways.empty()) {
+        return;
+    }
+
+    location_handler.way(*ways.front());
+    set_way_node_locations(std::next(ways.begin()), ways.end(), location_handler, ignore_errors);
+}
+
+#endif // WAY_NODE_LOCATIONS_HPP
@@ -0,0 +1,118 @@
+#include "test.hpp" // IWYU pragma: keep
+
+#include <memory>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/index/map/sparse_mem_array.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node_ref.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "compressed_location_map.hpp"
+#include "way_node_locations.hpp"
+
+TEST_CASE("Compressed location map is registered") {
+    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
+    REQUIRE(map_factory.has_map_type("compressed_mem"));
+
+    std::unique_ptr<osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>> map{map_factory.create_map("compressed_mem")};
+    REQUIRE(map->size() == 0);
+}
+
+TEST_CASE("Compressed location map stores locations") {
+    CompressedLocationMap map;
+
+    std::vector<osmium::Location> locations;
+    for (int i = 0; i < 1000; ++i) {
+        locations.emplace_back(1.0 + i * 0.0001, 2.0 - i * 0.0002);
+    }
+    locations[500] = osmium::Location{-179.9999999, -89.9999999};
+    locations[501] = osmium::Location{179.9999999, 89.9999999};
+
+    for (std::size_t i = 0; i < locations.size(); i += 3) {
+        map.set(i + 5, locations[i]);
+    }
+    REQUIRE(map.size() == 334);
+
+    for (std::size_t i = 0; i < locations.size(); ++i) {
+        if (i % 3 == 0) {
+            REQUIRE(map.get(i + 5) == locations[i]);
+        } else {
+            REQUIRE_FALSE(map.get_noexcept(i + 5).valid());
+            REQUIRE_THROWS_AS(map.get(i + 5), osmium::not_found);
+        }
+    }
+
+    REQUIRE_FALSE(map.get_noexcept(0).valid());
+    REQUIRE_FALSE(map.get_noexcept(1000000).valid());
+}
+
+TEST_CASE("Compressed location map with IDs set out of order") {
+    CompressedLocationMap map;
+
+    map.set(1000, osmium::Location{1.0, 1.0});
+    map.set(1, osmium::Location{2.0, 2.0});
+    map.set(1001, osmium::Location{3.0, 3.0});
+    map.set(2, osmium::Location{4.0, 4.0});
+    map.set(1, osmium::Location{5.0, 5.0});
+
+    REQUIRE(map.size() == 4);
+    REQUIRE(map.get(1) == osmium::Location(5.0, 5.0));
+    REQUIRE(map.get(2) == osmium::Location(4.0, 4.0));
+    REQUIRE(map.get(1000) == osmium::Location(1.0, 1.0));
+    REQUIRE(map.get(1001) == osmium::Location(3.0, 3.0));
+
+    map.clear();
+    REQUIRE(map.size() == 0);
+    REQUIRE_FALSE(map.get_noexcept(1).valid());
+}
+
+static osmium::Way& add_way(osmium::memory::Buffer& buffer) {
+    {
+        osmium::builder::WayBuilder builder{buffer};
+        builder.set_id(20);
+        osmium::builder::WayNodeListBuilder wnl_builder{builder};
+        wnl_builder.add_node_ref(osmium::NodeRef{10, osmium::Location{9.0, 9.0}});
+        wnl_builder.add_node_ref(osmium::NodeRef{11, osmium::Location{9.0, 9.0}});
+    }
+    return buffer.get<osmium::Way>(buffer.commit());
+}
+
+TEST_CASE("Way node locations") {
+    using index_type = osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type, osmium::Location>;
+
+    index_type index;
+    index.set(10, osmium::Location{1.0, 2.0});
+    index.sort();
+
+    osmium::memory::Buffer buffer{1024};
+    osmium::Way& way = add_way(buffer);
+
+    SECTION("Missing locations are invalidated like in the location handler") {
+        osmium::handler::NodeLocationsForWays<index_type> location_handler{index};
+        location_handler.ignore_errors();
+
+        std::vector<osmium::Way*> ways{&way};
+        set_way_node_locations(ways.begin(), ways.end(), location_handler, true);
+        REQUIRE(way.nodes()[0].location() == osmium::Location(1.0, 2.0));
+        REQUIRE_FALSE(way.nodes()[1].location().valid());
+
+        REQUIRE_THROWS_AS(set_way_node_locations(ways.begin(), ways.end(), location_handler, false), const osmium::not_found&);
+    }
+
+    SECTION("Missing locations can be kept") {
+        WayNodeLocations node_locations;
+        node_locations.add(way);
+        const auto missing = node_locations.set_locations([&index](osmium::object_id_type id) {
+            return index.get_noexcept(static_cast<osmium::unsigned_object_id_type>(id));
+        });
+        REQUIRE(missing == 1);
+        REQUIRE(way.nodes()[0].location() == osmium::Location(1.0, 2.0));
+        REQUIRE(way.nodes()[1].location() == osmium::Location(9.0, 9.0));
+    }
+}
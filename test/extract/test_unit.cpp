@@ -1,12 +1,33 @@
 
 #include "test.hpp" // IWYU pragma: keep
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/io/error.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/opl_output.hpp>
+#include <osmium/io/writer.hpp>
+#include <osmium/io/writer_options.hpp>
 #include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/segment.hpp>
 
+#include "envelope_grid.hpp"
 #include "exception.hpp"
+#include "extract_polygon.hpp"
+#include "point_in_polygon.hpp"
 #include "poly_file_parser.hpp"
 #include "osm_file_parser.hpp"
 #include "geojson_file_parser.hpp"
+#include "id_pair_sorter.hpp"
+#include "id_set.hpp"
+#include "writer_threads.hpp"
 
 TEST_CASE("Parse poly files") {
     osmium::memory::Buffer buffer{1024};
@@ -242,3 +263,351 @@ TEST_CASE("Parse GeoJSON files") {
 
 }
 
+TEST_CASE("Envelope grid") {
+    const std::vector<osmium::Box> boxes = {
+        osmium::Box{0.0, 0.0, 10.0, 10.0},
+        osmium::Box{5.0, 5.0, 6.0, 6.0},
+        osmium::Box{},
+        osmium::Box{-20.0, -20.0, -10.0, -10.0}
+    };
+    const EnvelopeGrid grid{boxes};
+
+    const auto candidates = [&grid](double x, double y) {
+        const auto c = grid.candidates(osmium::Location{x, y});
+        return std::vector<uint32_t>(c.first, c.second);
+    };
+
+    SECTION("Candidates include all boxes containing the location") {
+        for (double x = -25.0; x <= 15.0; x += 0.5) {
+            for (double y = -25.0; y <= 15.0; y += 0.5) {
+                const osmium::Location location{x, y};
+                const auto c = candidates(x, y);
+                for (uint32_t i = 0; i < boxes.size(); ++i) {
+                    if (boxes[i].valid() && boxes[i].contains(location)) {
+                        REQUIRE(std::find(c.begin(), c.end(), i) != c.end());
+                    }
+                }
+                REQUIRE(std::is_sorted(c.begin(), c.end()));
+            }
+        }
+    }
+
+    SECTION("No candidates outside all boxes") {
+        REQUIRE(candidates(-30.0, 0.0).empty());
+        REQUIRE(candidates(0.0, 20.0).empty());
+    }
+
+    SECTION("No candidates for invalid location") {
+        const auto c = grid.candidates(osmium::Location{});
+        REQUIRE(c.first == c.second);
+    }
+}
+
+TEST_CASE("Envelope grid without boxes") {
+    const EnvelopeGrid grid{std::vector<osmium::Box>{}};
+    const auto c = grid.candidates(osmium::Location{1.0, 2.0});
+    REQUIRE(c.first == c.second);
+}
+
+TEST_CASE("Point in polygon kernels") {
+    // star-shaped polygon with many segments and a square hole
+    std::vector<osmium::Location> ring;
+    for (int i = 0; i < 200; ++i) {
+        const double r = (i % 2) ? 1000.0 : 600.0;
+        const double angle = 2 * 3.14159265358979 * i / 200;
+        ring.emplace_back(static_cast<int32_t>(r * std::cos(angle)), static_cast<int32_t>(r * std::sin(angle)));
+    }
+
+    std::vector<osmium::Segment> segments;
+    for (std::size_t i = 0; i < ring.size(); ++i) {
+        segments.emplace_back(ring[i], ring[(i + 1) % ring.size()]);
+    }
+    segments.emplace_back(osmium::Location{-50, -50}, osmium::Location{50, -50});
+    segments.emplace_back(osmium::Location{50, -50}, osmium::Location{50, 50});
+    segments.emplace_back(osmium::Location{50, 50}, osmium::Location{-50, 50});
+    segments.emplace_back(osmium::Location{-50, 50}, osmium::Location{-50, -50});
+
+    osmium::Box envelope;
+    for (const auto& segment : segments) {
+        envelope.extend(segment.first());
+    }
+
+    const PolygonBands scalar{segments, envelope, pip_kernel::scalar};
+
+    REQUIRE_FALSE(available_pip_kernels().empty());
+    REQUIRE(available_pip_kernels().front() == pip_kernel::scalar);
+
+    SECTION("Kernels agree with scalar kernel") {
+        for (const auto kernel : available_pip_kernels()) {
+            const PolygonBands bands{segments, envelope, kernel};
+            for (int32_t x = envelope.bottom_left().x(); x <= envelope.top_right().x(); x += 7) {
+                for (int32_t y = envelope.bottom_left().y(); y <= envelope.top_right().y(); y += 5) {
+                    const osmium::Location location{x, y};
+                    REQUIRE(bands.contains(location) == scalar.contains(location));
+                }
+            }
+        }
+    }
+
+    SECTION("Vertices are inside") {
+        for (const auto kernel : available_pip_kernels()) {
+            const PolygonBands bands{segments, envelope, kernel};
+            for (const auto& location : ring) {
+                REQUIRE(bands.contains(location));
+            }
+        }
+    }
+
+    SECTION("Locations in the hole are outside") {
+        for (const auto kernel : available_pip_kernels()) {
+            const PolygonBands bands{segments, envelope, kernel};
+            REQUIRE_FALSE(bands.contains(osmium::Location{0, 0}));
+            REQUIRE_FALSE(bands.contains(osmium::Location{10, -20}));
+            REQUIRE(bands.contains(osmium::Location{300, 0}));
+            REQUIRE(bands.contains(osmium::Location{-100, 400}));
+        }
+    }
+
+    SECTION("SIMD kernels are not used for huge polygons") {
+        const osmium::Box huge{osmium::Location{-1800000000, -10}, osmium::Location{1800000000, 10}};
+        REQUIRE(best_pip_kernel(huge) == pip_kernel::scalar);
+    }
+}
+
+static void add_ring(osmium::builder::AreaBuilder& builder, const std::vector<osmium::Location>& ring, bool inner, std::vector<osmium::Segment>& segments) {
+    for (std::size_t i = 0; i + 1 < ring.size(); ++i) {
+        segments.emplace_back(ring[i], ring[i + 1]);
+    }
+    if (inner) {
+        osmium::builder::InnerRingBuilder ring_builder{builder};
+        for (const auto& location : ring) {
+            ring_builder.add_node_ref(0, location);
+        }
+    } else {
+        osmium::builder::OuterRingBuilder ring_builder{builder};
+        for (const auto& location : ring) {
+            ring_builder.add_node_ref(0, location);
+        }
+    }
+}
+
+// Compare ExtractPolygon::contains(), which uses the grid cells, with the
+// point-in-polygon test on the bands alone for every location in and
+// around the envelope. This includes all locations on cell edges and
+// corners.
+static void check_polygon_cells(const std::vector<osmium::Location>& outer, const std::vector<osmium::Location>& inner) {
+    osmium::memory::Buffer buffer{1024};
+    std::vector<osmium::Segment> segments;
+    {
+        osmium::builder::AreaBuilder builder{buffer};
+        add_ring(builder, outer, false, segments);
+        if (!inner.empty()) {
+            add_ring(builder, inner, true, segments);
+        }
+    }
+    const auto offset = buffer.commit();
+
+    const ExtractPolygon extract{osmium::io::File{"test.osm"}, "test", buffer, offset};
+    const osmium::Box& envelope = extract.envelope();
+    const PolygonBands bands{segments, envelope, pip_kernel::scalar};
+
+    std::size_t mismatches = 0;
+    for (int32_t y = envelope.bottom_left().y() - 2; y <= envelope.top_right().y() + 2; ++y) {
+        for (int32_t x = envelope.bottom_left().x() - 2; x <= envelope.top_right().x() + 2; ++x) {
+            const osmium::Location location{x, y};
+            const bool expected = envelope.contains(location) && bands.contains(location);
+            if (extract.contains(location) != expected) {
+                ++mismatches;
+            }
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Grid cells of polygon extracts") {
+    SECTION("Concave polygon with a hole") {
+        // The notch at the top has long diagonal segments going through
+        // many cells, the hole is a diamond.
+        const std::vector<osmium::Location> outer{
+            {0, 0}, {200, 0}, {200, 30}, {230, 30}, {230, 0}, {601, 0},
+            {601, 599}, {300, 151}, {0, 599}, {0, 300}, {40, 280}, {0, 260}, {0, 0}
+        };
+        const std::vector<osmium::Location> inner{
+            {300, 20}, {360, 80}, {300, 140}, {240, 80}, {300, 20}
+        };
+        check_polygon_cells(outer, inner);
+    }
+
+    SECTION("Thin diagonal polygon") {
+        const std::vector<osmium::Location> outer{
+            {0, 0}, {3, 0}, {997, 994}, {997, 997}, {994, 997}, {0, 3}, {0, 0}
+        };
+        check_polygon_cells(outer, {});
+    }
+}
+
+TEST_CASE("Adaptive ID set") {
+    IdSetAdaptive set;
+
+    REQUIRE(set.empty());
+    REQUIRE(set.begin() == set.end());
+    REQUIRE_FALSE(set.get(17));
+
+    SECTION("Sparse IDs far apart") {
+        const std::vector<osmium::unsigned_object_id_type> ids = {3, 1000000, 5000000017, 5000000018, 9000000000};
+        for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+            set.set(*it);
+        }
+        set.set(1000000);
+
+        REQUIRE(set.size() == ids.size());
+        REQUIRE(std::vector<osmium::unsigned_object_id_type>(set.begin(), set.end()) == ids);
+        for (const auto id : ids) {
+            REQUIRE(set.get(id));
+            REQUIRE_FALSE(set.get(id + 1 + (id == 5000000017)));
+        }
+    }
+
+    SECTION("Many IDs in some chunks") {
+        std::vector<osmium::unsigned_object_id_type> ids;
+        for (osmium::unsigned_object_id_type id = 100; id < 300000; id += 3) {
+            ids.push_back(id);
+        }
+        ids.push_back(7000000000);
+        for (const auto id : ids) {
+            set.set(id);
+        }
+
+        REQUIRE(set.size() == ids.size());
+        REQUIRE(std::vector<osmium::unsigned_object_id_type>(set.begin(), set.end()) == ids);
+        REQUIRE(set.get(100));
+        REQUIRE_FALSE(set.get(101));
+        REQUIRE(set.get(299998));
+        REQUIRE_FALSE(set.get(300001));
+    }
+
+    SECTION("Adding IDs while iterating") {
+        set.set(1);
+        for (const auto id : set) {
+            if (id < 100000) {
+                set.set(id * 2);
+            }
+        }
+        REQUIRE(set.size() == 18);
+        REQUIRE(set.get(131072));
+    }
+
+    SECTION("Small sets use little memory") {
+        for (osmium::unsigned_object_id_type id = 4000000000; id < 9000000000; id += 100000000) {
+            set.set(id);
+        }
+        REQUIRE(set.size() == 50);
+        REQUIRE(set.used_memory() < 10000);
+    }
+
+    SECTION("Dense set") {
+        IdSetAdaptive dense_set{true};
+        const std::vector<osmium::unsigned_object_id_type> ids = {3, 70000, 70001, 5000000017, 300000000000000};
+        for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+            dense_set.set(*it);
+        }
+
+        REQUIRE(dense_set.size() == ids.size());
+        REQUIRE(std::vector<osmium::unsigned_object_id_type>(dense_set.begin(), dense_set.end()) == ids);
+        REQUIRE(dense_set.get(70001));
+        REQUIRE_FALSE(dense_set.get(70002));
+        // 70000 and 70001 are in the same chunk
+        REQUIRE(dense_set.used_memory() >= 4 * IdSetAdaptive::bitmap_words * 8);
+    }
+}
+
+static std::vector<IdPairSorter::id_pair> sorted_id_pairs(std::size_t max_memory, std::size_t* num_runs) {
+    IdPairSorter sorter{max_memory};
+    for (uint64_t i = 0; i < 5000; ++i) {
+        sorter.add((i * 7919) % 1000, i % 3);
+    }
+    sorter.done();
+    *num_runs = sorter.num_runs();
+
+    std::vector<IdPairSorter::id_pair> pairs;
+    for (; !sorter.empty(); sorter.next()) {
+        pairs.push_back(sorter.get());
+    }
+    return pairs;
+}
+
+TEST_CASE("Sorting ID pairs") {
+    std::vector<IdPairSorter::id_pair> expected;
+    for (uint64_t i = 0; i < 3000; ++i) {
+        expected.push_back(IdPairSorter::id_pair{(i * 7919) % 1000, i % 3});
+    }
+    std::sort(expected.begin(), expected.end());
+
+    std::size_t num_runs = 0;
+
+    SECTION("In memory") {
+        const auto pairs = sorted_id_pairs(1024 * 1024, &num_runs);
+        REQUIRE(num_runs == 0);
+        REQUIRE(pairs == expected);
+    }
+
+    SECTION("In temporary files") {
+        // 10 pairs per run, so runs are merged several times
+        auto pairs = sorted_id_pairs(10 * sizeof(IdPairSorter::id_pair), &num_runs);
+        REQUIRE(num_runs == 500);
+        REQUIRE(std::is_sorted(pairs.begin(), pairs.end()));
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        REQUIRE(pairs == expected);
+    }
+}
+
+static const char* null_device() noexcept {
+#ifdef _WIN32
+    return "nul";
+#else
+    return "/dev/null";
+#endif
+}
+
+TEST_CASE("Writer threads with a failing writer") {
+    const osmium::io::File file{null_device(), "opl"};
+    osmium::io::Writer failing_writer{file, osmium::io::overwrite::allow};
+    osmium::io::Writer writer_same_queue{file, osmium::io::overwrite::allow};
+    osmium::io::Writer writer_other_queue{file, osmium::io::overwrite::allow};
+
+    // Writing to a closed writer fails.
+    failing_writer.close();
+
+    WriterThreads threads{2, 2};
+    const auto failing_queue = threads.assign();
+    const auto other_queue = threads.assign();
+    REQUIRE(failing_queue != other_queue);
+
+    threads.add(other_queue, writer_other_queue, osmium::memory::Buffer{1024});
+    threads.add(failing_queue, failing_writer, osmium::memory::Buffer{1024});
+    threads.close(other_queue, writer_other_queue);
+
+    // All tasks added to the failing queue after the failing one are
+    // dropped, so add() and close() never block for long. Once the thread
+    // has found the error, it is rethrown from them.
+    bool thrown = false;
+    while (!thrown) {
+        try {
+            threads.add(failing_queue, writer_same_queue, osmium::memory::Buffer{1024});
+            threads.close(failing_queue, writer_same_queue);
+        } catch (const osmium::io_error&) {
+            thrown = true;
+        }
+    }
+
+    REQUIRE_THROWS_AS(threads.close(failing_queue, writer_same_queue), const osmium::io_error&);
+    REQUIRE_THROWS_AS(threads.finish(), const osmium::io_error&);
+
+    // The close tasks for the other writer in the failing queue were
+    // dropped, so it can still be written to.
+    REQUIRE_NOTHROW(writer_same_queue(osmium::memory::Buffer{1024}));
+    writer_same_queue.close();
+
+    // The other queue wasn't affected by the error, the writer was closed.
+    REQUIRE_THROWS_AS(writer_other_queue(osmium::memory::Buffer{1024}), const osmium::io_error&);
+}
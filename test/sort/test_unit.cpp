@@ -0,0 +1,311 @@
+
+#include "test.hpp" // IWYU pragma: keep
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <osmium/builder/attr.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/object_comparisons.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/visitor.hpp>
+
+#include "external_sort.hpp"
+#include "parallel_sort.hpp"
+#include "sort_keys.hpp"
+
+static void add_objects(osmium::memory::Buffer& buffer) {
+    using namespace osmium::builder::attr;
+
+    osmium::builder::add_way(buffer, _id(3), _version(1));
+    osmium::builder::add_node(buffer, _id(17), _version(2), _timestamp("2017-01-02T00:00:00Z"));
+    osmium::builder::add_node(buffer, _id(-4), _version(1));
+    osmium::builder::add_relation(buffer, _id(1), _version(3));
+    osmium::builder::add_node(buffer, _id(17), _version(1));
+    osmium::builder::add_node(buffer, _id(0), _version(1));
+    osmium::builder::add_node(buffer, _id(4), _version(1));
+    osmium::builder::add_node(buffer, _id(17), _version(2), _timestamp("2017-01-01T00:00:00Z"));
+    osmium::builder::add_way(buffer, _id(-3), _version(7));
+    osmium::builder::add_node(buffer, _id(-1), _version(1));
+    osmium::builder::add_way(buffer, _id(3), _version(2));
+}
+
+template <typename TCompare>
+static void check_order(sort_order order, TCompare compare, unsigned int num_threads) {
+    osmium::memory::Buffer buffer{1024};
+    add_objects(buffer);
+
+    std::vector<const osmium::OSMObject*> expected;
+    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+        expected.push_back(&object);
+    }
+    std::sort(expected.begin(), expected.end(), [&compare](const osmium::OSMObject* lhs, const osmium::OSMObject* rhs) {
+        return compare(*lhs, *rhs);
+    });
+
+    SortKeyCollection keys{order};
+    osmium::apply(buffer, keys);
+    REQUIRE(keys.size() == expected.size());
+    keys.sort(num_threads);
+
+    auto it = expected.cbegin();
+    for (const auto& key : keys) {
+        REQUIRE(key.object == *it);
+        ++it;
+    }
+}
+
+TEST_CASE("Sort keys in type/id/version order") {
+    check_order(sort_order::type_id_version, osmium::object_order_type_id_version{}, 1);
+    check_order(sort_order::type_id_version, osmium::object_order_type_id_version{}, 4);
+}
+
+TEST_CASE("Sort keys in type/id/reverse version order") {
+    check_order(sort_order::type_id_reverse_version, osmium::object_order_type_id_reverse_version{}, 1);
+    check_order(sort_order::type_id_reverse_version, osmium::object_order_type_id_reverse_version{}, 4);
+}
+
+// More objects than needed for the radix sort to be used. There are
+// negative IDs, several versions of many objects, and objects with the
+// same type, ID, and version but different timestamps.
+static void add_many_objects(osmium::memory::Buffer& buffer) {
+    using namespace osmium::builder::attr;
+
+    std::uint32_t x = 1;
+    for (int i = 0; i < 3000; ++i) {
+        x = x * 1103515245U + 12345U;
+        const auto id = static_cast<osmium::object_id_type>((x >> 8U) % 2001) - 1000;
+        const auto version = static_cast<osmium::object_version_type>(1 + (x >> 20U) % 4);
+        const osmium::Timestamp timestamp{static_cast<std::uint32_t>(1500000000 + (x >> 24U) % 3)};
+        switch (i % 3) {
+            case 0:
+                osmium::builder::add_node(buffer, _id(id), _version(version), _timestamp(timestamp));
+                break;
+            case 1:
+                osmium::builder::add_way(buffer, _id(id), _version(version), _timestamp(timestamp));
+                break;
+            default:
+                osmium::builder::add_relation(buffer, _id(id), _version(version), _timestamp(timestamp));
+                break;
+        }
+    }
+}
+
+template <typename TCompare>
+static void check_order_many(sort_order order, TCompare compare) {
+    osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    add_many_objects(buffer);
+
+    std::vector<const osmium::OSMObject*> expected;
+    for (const auto& object : buffer.select<osmium::OSMObject>()) {
+        expected.push_back(&object);
+    }
+    std::stable_sort(expected.begin(), expected.end(), [&compare](const osmium::OSMObject* lhs, const osmium::OSMObject* rhs) {
+        return compare(*lhs, *rhs);
+    });
+
+    SortKeyCollection keys{order};
+    osmium::apply(buffer, keys);
+    REQUIRE(keys.size() == expected.size());
+    keys.sort();
+
+    // Objects that compare equal are identical in all attributes checked
+    // here, so their order doesn't matter.
+    auto it = expected.cbegin();
+    for (const auto& key : keys) {
+        REQUIRE(key.object->type() == (*it)->type());
+        REQUIRE(key.object->id() == (*it)->id());
+        REQUIRE(key.object->version() == (*it)->version());
+        REQUIRE(key.object->timestamp() == (*it)->timestamp());
+        ++it;
+    }
+}
+
+TEST_CASE("Radix sort keys in type/id/version order") {
+    check_order_many(sort_order::type_id_version, osmium::object_order_type_id_version{});
+}
+
+TEST_CASE("Radix sort keys in type/id/reverse version order") {
+    check_order_many(sort_order::type_id_reverse_version, osmium::object_order_type_id_reverse_version{});
+}
+
+TEST_CASE("Sort keys with huge IDs fall back to comparing objects") {
+    using namespace osmium::builder::attr;
+
+    osmium::memory::Buffer buffer{1024};
+    osmium::builder::add_node(buffer, _id(1LL << 62), _version(1));
+    osmium::builder::add_node(buffer, _id(5), _version(1));
+    osmium::builder::add_node(buffer, _id(-(1LL << 61)), _version(1));
+
+    SortKeyCollection keys{sort_order::type_id_version};
+    osmium::apply(buffer, keys);
+    keys.sort();
+
+    std::vector<osmium::object_id_type> ids;
+    for (const auto& key : keys) {
+        ids.push_back(key.object->id());
+    }
+    REQUIRE(ids == std::vector<osmium::object_id_type>({-(1LL << 61), 5, 1LL << 62}));
+}
+
+TEST_CASE("Unique sort keys") {
+    osmium::memory::Buffer buffer{1024};
+    add_objects(buffer);
+
+    SortKeyCollection keys{sort_order::type_id_reverse_version};
+    osmium::apply(buffer, keys);
+    keys.sort();
+    keys.unique();
+
+    REQUIRE(keys.size() == 8);
+    const auto it = std::find_if(keys.begin(), keys.end(), [](const sort_key& key) {
+        return key.object->type() == osmium::item_type::node && key.object->id() == 17;
+    });
+    REQUIRE(it != keys.end());
+    REQUIRE(it->object->version() == 2);
+}
+
+
+TEST_CASE("External sort merges runs if there are too many") {
+    using namespace osmium::builder::attr;
+
+    ExternalSorter sorter{1024 * 1024, 1};
+
+    // pseudo-random IDs, so that nearly all objects are out of order
+    std::vector<osmium::object_id_type> ids;
+    osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    std::uint64_t x = 1;
+    for (int i = 0; i < 300000; ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        const auto id = static_cast<osmium::object_id_type>(x >> 40U);
+        ids.push_back(id);
+        osmium::builder::add_node(buffer, _id(id), _version(1), _user("test"));
+        if (buffer.committed() > 512 * 1024) {
+            sorter.add(buffer);
+            buffer.clear();
+        }
+    }
+    sorter.add(buffer);
+    sorter.done();
+
+    REQUIRE(sorter.num_runs() > ExternalSorter::merge_fan_in);
+    REQUIRE(sorter.runs().size() <= ExternalSorter::merge_fan_in);
+
+    std::sort(ids.begin(), ids.end());
+    std::vector<osmium::object_id_type> result;
+    RunMerger merger{sorter.runs()};
+    for (; !merger.empty(); merger.next()) {
+        result.push_back(merger.get().id());
+    }
+    REQUIRE(result == ids);
+}
+
+static void add_nodes(ExternalSorter& sorter, const std::vector<osmium::object_id_type>& ids) {
+    using namespace osmium::builder::attr;
+
+    osmium::memory::Buffer buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    for (const auto id : ids) {
+        osmium::builder::add_node(buffer, _id(id), _version(1), _user("test"));
+    }
+    sorter.add(buffer);
+}
+
+static std::vector<osmium::object_id_type> merged_ids(ExternalSorter& sorter) {
+    std::vector<osmium::object_id_type> ids;
+    RunMerger merger{sorter.runs()};
+    for (; !merger.empty(); merger.next()) {
+        ids.push_back(merger.get().id());
+    }
+    return ids;
+}
+
+static std::vector<osmium::object_id_type> id_range(osmium::object_id_type first, osmium::object_id_type last) {
+    std::vector<osmium::object_id_type> ids;
+    for (auto id = first; id < last; ++id) {
+        ids.push_back(id);
+    }
+    return ids;
+}
+
+TEST_CASE("External sort writes sorted stretches larger than a buffer directly") {
+    ExternalSorter sorter{1024 * 1024, 1};
+
+    // much more than one buffer of the runs
+    const auto ids = id_range(1, 20000);
+    REQUIRE(ids.size() * 32 > sorter.buffer_size());
+    add_nodes(sorter, ids);
+    sorter.done();
+
+    REQUIRE(sorter.num_runs() == 1);
+    REQUIRE(sorter.num_presorted_runs() == 1);
+    REQUIRE(merged_ids(sorter) == ids);
+}
+
+TEST_CASE("External sort with sorted and unsorted stretches") {
+    ExternalSorter sorter{1024 * 1024, 1};
+
+    std::vector<osmium::object_id_type> expected;
+    const auto add = [&](const std::vector<osmium::object_id_type>& ids) {
+        add_nodes(sorter, ids);
+        expected.insert(expected.end(), ids.begin(), ids.end());
+    };
+
+    std::vector<osmium::object_id_type> unsorted1 = id_range(50, 100);
+    std::reverse(unsorted1.begin(), unsorted1.end());
+    std::vector<osmium::object_id_type> unsorted2 = id_range(150000, 150100);
+    std::reverse(unsorted2.begin(), unsorted2.end());
+
+    add(id_range(100000, 120000));
+    add(unsorted1);
+    add(id_range(200000, 220000));
+    add(unsorted2);
+    // a short sorted stretch is treated like unsorted objects
+    add(id_range(10, 20));
+    sorter.done();
+
+    // two sorted stretches, one run with all the other objects
+    REQUIRE(sorter.num_presorted_runs() == 2);
+    REQUIRE(sorter.num_runs() == 3);
+
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(merged_ids(sorter) == expected);
+}
+
+TEST_CASE("Parallel sort of enough data to use several threads") {
+    // value and original position, only the value is compared
+    using element = std::pair<std::uint32_t, std::size_t>;
+    const auto less = [](const element& lhs, const element& rhs) {
+        return lhs.first < rhs.first;
+    };
+
+    // an odd number of elements above the threshold, many duplicates
+    std::vector<element> data;
+    std::uint32_t x = 1;
+    for (std::size_t i = 0; i < detail::min_parallel_sort_size * 2 + 7; ++i) {
+        x = x * 1103515245U + 12345U;
+        data.emplace_back((x >> 16U) % 5000, i);
+    }
+
+    auto expected = data;
+    std::stable_sort(expected.begin(), expected.end(), less);
+
+    for (unsigned int num_threads = 2; num_threads <= 4; ++num_threads) {
+        auto sorted = data;
+        parallel_sort(sorted, less, num_threads, [&less](std::vector<element>::iterator first, std::vector<element>::iterator last) {
+            std::stable_sort(first, last, less);
+        });
+        REQUIRE(sorted == expected);
+
+        auto sorted_unstable = data;
+        parallel_sort(sorted_unstable, less, num_threads);
+        REQUIRE(std::is_sorted(sorted_unstable.begin(), sorted_unstable.end(), less));
+        std::sort(sorted_unstable.begin(), sorted_unstable.end());
+        auto all = data;
+        std::sort(all.begin(), all.end());
+        REQUIRE(sorted_unstable == all);
+    }
+}